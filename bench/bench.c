@@ -0,0 +1,345 @@
+/*** typeAway microbenchmarks ***/
+// Build and run from the repository root:
+//     gcc -O2 -pthread bench/bench.c -o typeAwayBench -lm
+//     ./typeAwayBench --json bench_output.txt
+//     ./typeAwayBench --baseline bench_output.txt
+// Every kernel runs against synthetic documents, so no terminal or file is needed.
+
+#define main typeAwayMain
+#include "../typeAway.c"
+#undef main
+
+#include <math.h>
+
+/*** options ***/
+struct benchOptions {
+    int warmup; // untimed runs before sampling
+    int samples;
+    long iterations; // calls per sample, 0 = calibrate to ~10ms per sample
+    char *filter;
+    char *jsonPath;
+    char *baselinePath;
+    double threshold; // relative slowdown that counts as a regression
+};
+struct benchOptions options = { 3, 15, 0, NULL, NULL, NULL, 0.10 };
+
+/*** synthetic documents ***/
+char *codeLines[] = {
+    "#include <stdio.h>",
+    "struct point { int x, y; };",
+    "static int distance(struct point *a, struct point *b) {",
+    "    int dx = a->x - b->x, dy = a->y - b->y; // squared",
+    "    return dx * dx + dy * dy;",
+    "}",
+    "int main(int argc, char *argv[]) {",
+    "    for (int i = 0; i < 100; i ++) printf(\"%d\\n\", i * 3.14);",
+    "    if (argc > 1 && argv[1][0] == 'x') return 1;",
+    "    return 0;",
+    "}",
+    NULL
+};
+char *commentLines[] = {
+    "/* A block comment that opens here",
+    " * and keeps going with 1234 numbers and \"quotes\"",
+    " * across several lines of prose */",
+    "int value = 42; // trailing comment with keywords: if while return",
+    "// a line that is only a comment",
+    "/* inline */ char *s = \"not /* a comment */\"; /* another */",
+    NULL
+};
+char *tabLines[] = {
+    "\tif (x)\t{\t\treturn\t1;\t}",
+    "\t\t\tint\ta\t=\t1,\tb\t=\t2;",
+    "\t\t\t\t\t\t/*\tdeep\t*/\tcall(a,\tb);",
+    "\t}\t\t\t\t\t\t\t\t\t\t\t\t//\tend",
+    NULL
+};
+
+void resetDocument() {
+    for (int j = 0; j < editor.numrows; j ++) freeRow(&editor.row[j]);
+    rowTreeRemove(0, editor.numrows);
+    free(editor.row);
+    editor.row = NULL;
+    editor.rowCap = 0;
+    editor.numrows = 0;
+    clearSymbols();
+    memset(&editor.totals, 0, sizeof(editor.totals));
+    editor.xCoord = editor.yCoord = editor.rx = 0;
+    editor.rowOffset = editor.colOffset = 0;
+}
+void buildDocument(char **lines, int numrows) {
+    resetDocument();
+    for (int j = 0; j < numrows; j ++) {
+        int k = 0;
+        while (lines[k]) k ++;
+        char *line = lines[j % k];
+        insertRow(editor.numrows, line, strlen(line));
+    }
+    editor.dirty = 0;
+}
+void buildLongLines(int numrows, int width) {
+    resetDocument();
+    char *line = malloc(width);
+    char *pattern = "value = call(a, \"text\", 12.5); /* note */ while (x) ";
+    int plen = strlen(pattern);
+    for (int j = 0; j < width; j ++) line[j] = pattern[j % plen];
+    for (int j = 0; j < numrows; j ++) insertRow(editor.numrows, line, width);
+    free(line);
+    editor.dirty = 0;
+}
+void buildHugeDocument(int numrows) {
+    resetDocument();
+    char line[64];
+    for (int j = 0; j < numrows; j ++) {
+        int len = snprintf(line, sizeof(line), "row %d: the quick brown fox", j);
+        insertRow(editor.numrows, line, len);
+    }
+    editor.dirty = 0;
+}
+long documentBytes() {
+    long total = 0;
+    for (int j = 0; j < editor.numrows; j ++) total += editor.row[j].size + 1;
+    return total;
+}
+
+/*** kernels ***/
+volatile long sink; // keeps results alive so the compiler can't drop the work
+
+void setupCode() { buildDocument(codeLines, 2000); }
+void setupComments() { buildDocument(commentLines, 2000); }
+void setupTabs() { buildDocument(tabLines, 2000); }
+void setupLong() { buildLongLines(200, 8000); }
+void setupHuge() { buildHugeDocument(1000000); }
+
+void runUpdateSyntax() {
+    for (int j = 0; j < editor.numrows; j ++) updateSyntax(&editor.row[j]);
+}
+void runUpdateRow() {
+    for (int j = 0; j < editor.numrows; j ++) updateRow(&editor.row[j]);
+}
+void runXCoordTorx() {
+    long total = 0;
+    for (int j = 0; j < editor.numrows; j ++) total += xCoordTorx(&editor.row[j], editor.row[j].size);
+    sink = total;
+}
+void runRxToxCoord() {
+    long total = 0;
+    for (int j = 0; j < editor.numrows; j ++) total += rxToxCoord(&editor.row[j], editor.row[j].rsize);
+    sink = total;
+}
+void runIndicateRows() {
+    struct abuf ab = ABUF_INIT;
+    indicateRows(&ab);
+    sink = ab.len;
+    abFree(&ab);
+}
+void runFind() { // the only match is on the last row, so every call scans the whole buffer
+    editorFindCallback("the slow brown fox", 0);
+    sink = editor.yCoord;
+}
+void setupFind() {
+    setupHuge();
+    char *last = "row end: the slow brown fox";
+    insertRow(editor.numrows, last, strlen(last));
+}
+void teardownFind() {
+    editorFindCallback("", '\x1b');
+}
+void runReplaceAll() { // swaps every bracket for itself, so the document is the same for the next call
+    struct replacer r;
+    int rows;
+    initReplacer(&r, "(", "(", 0);
+    sink = replaceAll(&r, &rows);
+    dropUndo();
+}
+void runRowsToString() {
+    int len;
+    char *buf = rowsToString(&len);
+    sink = len;
+    free(buf);
+}
+
+struct kernel {
+    char *name;
+    void (*setup)();
+    void (*run)();
+    void (*teardown)();
+    int perByte; // report throughput over the document size
+};
+struct kernel KERNELS[] = {
+    { "updateSyntax/code", setupCode, runUpdateSyntax, NULL, 1 },
+    { "updateSyntax/comments", setupComments, runUpdateSyntax, NULL, 1 },
+    { "updateSyntax/long-lines", setupLong, runUpdateSyntax, NULL, 1 },
+    { "updateRow/tabs", setupTabs, runUpdateRow, NULL, 1 },
+    { "updateRow/long-lines", setupLong, runUpdateRow, NULL, 1 },
+    { "xCoordTorx/tabs", setupTabs, runXCoordTorx, NULL, 1 },
+    { "xCoordTorx/long-lines", setupLong, runXCoordTorx, NULL, 1 },
+    { "rxToxCoord/tabs", setupTabs, runRxToxCoord, NULL, 1 },
+    { "rxToxCoord/long-lines", setupLong, runRxToxCoord, NULL, 1 },
+    { "indicateRows/code", setupCode, runIndicateRows, NULL, 0 },
+    { "indicateRows/tabs", setupTabs, runIndicateRows, NULL, 0 },
+    { "indicateRows/long-lines", setupLong, runIndicateRows, NULL, 0 },
+    { "editorFindCallback/huge", setupFind, runFind, teardownFind, 1 },
+    { "replaceAll/code", setupCode, runReplaceAll, NULL, 1 },
+    { "rowsToString/huge", setupHuge, runRowsToString, NULL, 1 }
+};
+
+#define KERNEL_ENTRIES (sizeof(KERNELS) / sizeof(KERNELS[0]))
+
+/*** measurement ***/
+struct result {
+    char *name;
+    long iterations;
+    double minNs, medianNs, meanNs, stddevNs; // per call
+    double mbPerSec;
+};
+
+double nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+double timeRuns(struct kernel *k, long iterations) {
+    double start = nowNs();
+    for (long i = 0; i < iterations; i ++) k -> run();
+    return nowNs() - start;
+}
+int compareDouble(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+void measure(struct kernel *k, struct result *r) {
+    k -> setup();
+    long bytes = documentBytes();
+    for (int i = 0; i < options.warmup; i ++) k -> run();
+
+    long iterations = options.iterations;
+    if (iterations <= 0) { // grow until one sample takes at least 10ms
+        iterations = 1;
+        while (timeRuns(k, iterations) < 1e7 && iterations < (1L << 30)) iterations *= 2;
+    }
+
+    double *perCall = malloc(sizeof(double) * options.samples);
+    for (int s = 0; s < options.samples; s ++) perCall[s] = timeRuns(k, iterations) / iterations;
+    if (k -> teardown) k -> teardown();
+
+    qsort(perCall, options.samples, sizeof(double), compareDouble);
+    double sum = 0, squares = 0;
+    for (int s = 0; s < options.samples; s ++) sum += perCall[s];
+    double mean = sum / options.samples;
+    for (int s = 0; s < options.samples; s ++) squares += (perCall[s] - mean) * (perCall[s] - mean);
+
+    r -> name = k -> name;
+    r -> iterations = iterations;
+    r -> minNs = perCall[0];
+    r -> medianNs = perCall[options.samples / 2];
+    r -> meanNs = mean;
+    r -> stddevNs = options.samples > 1 ? sqrt(squares / (options.samples - 1)) : 0;
+    r -> mbPerSec = k -> perByte ? bytes / (r -> medianNs / 1e9) / 1e6 : 0;
+    free(perCall);
+}
+
+/*** reporting ***/
+void writeJson(FILE *out, struct result *results, int n) {
+    fprintf(out, "{\n  \"benchmark\": \"typeAway\",\n  \"warmup\": %d,\n  \"samples\": %d,\n  \"kernels\": [\n",
+            options.warmup, options.samples);
+    for (int j = 0; j < n; j ++) {
+        struct result *r = &results[j];
+        // one kernel per line keeps --baseline parsing trivial
+        fprintf(out, "    {\"name\": \"%s\", \"iterations\": %ld, \"min_ns\": %.1f, \"median_ns\": %.1f, "
+                "\"mean_ns\": %.1f, \"stddev_ns\": %.1f, \"mb_per_s\": %.2f}%s\n",
+                r -> name, r -> iterations, r -> minNs, r -> medianNs, r -> meanNs, r -> stddevNs,
+                r -> mbPerSec, j + 1 < n ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+int baselineMedian(FILE *fp, char *name, double *median) {
+    char line[512], key[128];
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = strstr(line, "\"name\": \"");
+        char *m = strstr(line, "\"median_ns\": ");
+        if (!p || !m) continue;
+        if (sscanf(p + 9, "%127[^\"]", key) != 1 || strcmp(key, name)) continue;
+        return sscanf(m + 13, "%lf", median) == 1;
+    }
+    return 0;
+}
+int compareBaseline(struct result *results, int n) { // returns the number of regressions
+    FILE *fp = fopen(options.baselinePath, "r");
+    if (!fp) {
+        perror(options.baselinePath);
+        return -1;
+    }
+    int regressions = 0;
+    fprintf(stderr, "\n%-28s %14s %14s %9s\n", "kernel", "baseline ns", "current ns", "change");
+    for (int j = 0; j < n; j ++) {
+        double base;
+        if (!baselineMedian(fp, results[j].name, &base)) {
+            fprintf(stderr, "%-28s %14s %14.1f %9s\n", results[j].name, "-", results[j].medianNs, "new");
+            continue;
+        }
+        double change = (results[j].medianNs - base) / base;
+        int regressed = change > options.threshold;
+        regressions += regressed;
+        fprintf(stderr, "%-28s %14.1f %14.1f %+8.1f%%%s\n", results[j].name, base, results[j].medianNs,
+                change * 100, regressed ? "  REGRESSION" : "");
+    }
+    fclose(fp);
+    return regressions;
+}
+
+/*** MAIN ***/
+void usage(char *argv0) {
+    fprintf(stderr, "usage: %s [--warmup N] [--samples N] [--iterations N] [--filter TEXT]\n"
+            "       [--json FILE] [--baseline FILE] [--threshold PERCENT] [--list]\n", argv0);
+    exit(2);
+}
+int main(int argc, char *argv[]) {
+    for (int j = 1; j < argc; j ++) {
+        char *arg = argv[j];
+        if (!strcmp(arg, "--list")) {
+            for (unsigned int k = 0; k < KERNEL_ENTRIES; k ++) printf("%s\n", KERNELS[k].name);
+            return 0;
+        }
+        if (j + 1 >= argc) usage(argv[0]);
+        char *value = argv[++ j];
+        if (!strcmp(arg, "--warmup")) options.warmup = atoi(value);
+        else if (!strcmp(arg, "--samples")) options.samples = atoi(value);
+        else if (!strcmp(arg, "--iterations")) options.iterations = atol(value);
+        else if (!strcmp(arg, "--filter")) options.filter = value;
+        else if (!strcmp(arg, "--json")) options.jsonPath = value;
+        else if (!strcmp(arg, "--baseline")) options.baselinePath = value;
+        else if (!strcmp(arg, "--threshold")) options.threshold = atof(value) / 100;
+        else usage(argv[0]);
+    }
+    if (options.samples < 1) options.samples = 1;
+
+    // the editor state the kernels run against; no terminal is attached
+    initBuffer();
+    editor.terminalRows = 50;
+    editor.terminalCols = 200;
+    editor.fileName = strdup("bench.c");
+    selectSyntaxHighlight();
+
+    struct result results[KERNEL_ENTRIES];
+    int n = 0;
+    for (unsigned int k = 0; k < KERNEL_ENTRIES; k ++) {
+        if (options.filter && !strstr(KERNELS[k].name, options.filter)) continue;
+        measure(&KERNELS[k], &results[n]);
+        fprintf(stderr, "%-28s %12.1f ns/op (min %.1f, sd %.1f, %ld iters)\n", results[n].name,
+                results[n].medianNs, results[n].minNs, results[n].stddevNs, results[n].iterations);
+        n ++;
+    }
+
+    FILE *out = stdout;
+    if (options.jsonPath && !(out = fopen(options.jsonPath, "w"))) {
+        perror(options.jsonPath);
+        return 1;
+    }
+    writeJson(out, results, n);
+    if (out != stdout) fclose(out);
+
+    if (options.baselinePath) return compareBaseline(results, n) ? 1 : 0;
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*** typeAway tests ***/
+// Build and run from the repository root:
+//     gcc -O2 -pthread tests/tests.c -o typeAwayTests
+//     ./typeAwayTests
+// Each test works on files in a fresh directory under /tmp, the compressed ones need gzip and zstd on the PATH.
+
+#define main typeAwayMain
+#include "../typeAway.c"
+#undef main
+
+/*** helpers ***/
+int failures;
+
+void check(int ok, char *test, char *what) {
+    printf("%s %s: %s\n", ok ? "pass" : "FAIL", test, what);
+    if (!ok) failures ++;
+}
+int startsWith(char *path, unsigned char *magic, int len) { // whether the file on disk begins with magic
+    unsigned char head[8];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    int n = read(fd, head, len);
+    close(fd);
+    return n == len && !memcmp(head, magic, len);
+}
+void typeLine(char *line) {
+    insertRow(editor.numrows, line, strlen(line));
+}
+int reopenedAs(char *path, char *line) { // whether the file reads back as the single row line
+    freeBuffer();
+    initBuffer();
+    if (editorOpen(path) == -1) return 0;
+    finishLoading();
+    return editor.numrows == 1 && !strcmp(editor.row[0].chars, line) && editor.readError == 0;
+}
+
+/*** tests ***/
+void testNewCompressedFile(char *dir) { // a .gz that doesn't exist yet is saved compressed
+    char path[256];
+    snprintf(path, sizeof(path), "%s/new.log.gz", dir);
+    initBuffer();
+    check(editorOpen(path) == -1 && errno == ENOENT, "new .gz", "opening reports the missing file");
+    check(editor.codec == codecForExtension(".gz"), "new .gz", "codec comes from the extension");
+    typeLine("hello, compressed world");
+    check(writeFile() != -1, "new .gz", "saves");
+    check(startsWith(path, CODECS[0].magic, CODECS[0].magicLen), "new .gz", "saved file has the gzip magic");
+    check(reopenedAs(path, "hello, compressed world"), "new .gz", "reads back what was saved");
+    freeBuffer();
+}
+void testEmptyCompressedFile(char *dir) { // too short for any magic, the extension decides
+    char path[256];
+    snprintf(path, sizeof(path), "%s/empty.log.zst", dir);
+    close(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    initBuffer();
+    check(editorOpen(path) == 0, "empty .zst", "opens");
+    finishLoading();
+    check(editor.numrows == 0 && editor.readError == 0, "empty .zst", "loads as an empty buffer");
+    typeLine("zstd from nothing");
+    check(writeFile() != -1, "empty .zst", "saves");
+    check(startsWith(path, CODECS[1].magic, CODECS[1].magicLen), "empty .zst", "saved file has the zstd magic");
+    check(reopenedAs(path, "zstd from nothing"), "empty .zst", "reads back what was saved");
+    freeBuffer();
+}
+void testMagicBeatsExtension(char *dir) { // plain text named .gz stays readable as it is
+    char path[256];
+    snprintf(path, sizeof(path), "%s/plain.log.gz", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    write(fd, "not compressed\n", 15);
+    close(fd);
+    initBuffer();
+    check(editorOpen(path) == 0, "plain .gz", "opens");
+    finishLoading();
+    check(editor.numrows == 1 && !strcmp(editor.row[0].chars, "not compressed") && editor.readError == 0,
+            "plain .gz", "loads the text without decompressing it");
+    freeBuffer();
+}
+
+/*** main ***/
+int main() {
+    char dir[] = "/tmp/typeAwayTests.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    testNewCompressedFile(dir);
+    testEmptyCompressedFile(dir);
+    testMagicBeatsExtension(dir);
+
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    system(command);
+    printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+    return failures ? 1 : 0;
+}
@@ -15,12 +15,23 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <regex.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 //#include "search.h"
 
 /*** defining our own macros***/
 #define CTRL_KEY(key) ((key) & 0x1f) // ANDing with 31 i.e 1f in hexadecimal ex: 'a' - 97, 'a' & 0x1f - 1 
 #define ABUF_INIT {NULL, 0}
+#define COMPLETION_MAX 8
+#define GUTTER_COLS 1 // change markers left of the text
+#define TEXT_COLS (editor.terminalCols - GUTTER_COLS)
 
 
 enum keys { 
@@ -43,12 +54,23 @@ enum highlight {
     HL_STRING,
     HL_NUMBER,
     HL_TEXT,
-    HL_MATCH
+    HL_MATCH,
+    HL_BRACKET,
+    HL_SELECTION
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_TEXT (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
+#define HL_INDEX_SYMBOLS (1 << 2)
+
+enum symbolKind {
+    SYM_FUNCTION = 0,
+    SYM_STRUCT,
+    SYM_UNION,
+    SYM_ENUM,
+    SYM_TYPEDEF
+};
 
 /***Data***/
 
@@ -61,31 +83,203 @@ struct editorSyntax {
     char *multiLineCommentsEnd;
     int flags;
 };
+struct hlSpan { // a run of render columns with one highlight class, runs start where the previous one ends
+    unsigned short len : 12; // packed into two bytes, longer runs are split
+    unsigned short hl : 4;
+};
+#define HL_SPAN_MAX 4095
+struct overlay { // highlight drawn over a row's spans without touching them
+    int row; // -1 when unused
+    int start, len;
+    int hl;
+};
+enum overlaySlot {
+    OVERLAY_SEARCH = 0,
+    OVERLAY_BRACKET,
+    OVERLAY_PARTNER,
+    OVERLAY_COUNT
+};
+
+#define BRACKET_KINDS 3
+struct bracketDepth { // net depth change across a row and the lowest depth reached inside it
+    int net, minPrefix;
+};
+struct rowRange { // rows [from, to] touched since some point, -1 when none
+    int from, to;
+};
+struct rowSummary { // per row aggregate, combined over ranges of rows by the row tree
+    struct bracketDepth brackets[BRACKET_KINDS];
+    int words, chars, bytes; // the line break counts as a char and a byte
+    int height; // screen lines the row takes while soft wrapping
+};
+struct rowNode { // a row in the row tree, a treap ordered by row index so rows go in and out in O(log n)
+    struct rowSummary row, sum; // the row's own summary and the one of its whole subtree
+    int left, right, size; // children, 0 for none, and the rows in the subtree
+    unsigned int priority;
+};
+struct textStats { // counts over a document or a selection
+    long words, chars, bytes;
+};
 typedef struct editorRow {
     int index;
     int size, rsize;
     char *chars;
+    int *shared; // reference count while chars is also held by the clipboard, NULL when owned
     char *render;
-    char *hl; //highlighting
+    struct hlSpan *hl; //highlighting, trailing HL_NORMAL columns are left out
+    int hlSpans;
     int hlOpenComment;
+    unsigned char hlStartComment; // the state highlightRow last started the row in, what an evicted row is rebuilt from
+    struct rowSummary summary;
+    unsigned int hash; // of chars, what the diff compares
+    int *idents; // trie nodes of the identifiers on the row
+    int numIdents;
+    unsigned int identKey; // hash and comment state the idents were taken from
+    int identEpoch;
+    int *wraps; // render columns where the screen lines after the first start, NULL when it fits on one
+    int wrapWidth; // width the wraps were found for, 0 when they need finding again
+    unsigned int lastUsed; // cacheTick when render and hl were last needed, old ones go first when memory is short
+    char diffMark; // gutter marker: ' ' unchanged, '+' added, '~' changed, '-' lines removed below
 } editorRow;
 
+struct symbol { // one definition found while highlighting a row
+    char *name;
+    int kind;
+    int row; // file row, kept in sync by insertRow/delRow
+    int rx; // render column of the name
+};
+
+struct fileLoader { // rows streamed in by a background reader thread
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;
+    int fd;
+    pid_t pid; // decompressor feeding fd, or 0 for plain files
+    char *pending; // bytes read but not yet handed to the editor
+    size_t pendingLen, pendingCap;
+    char *work; // bytes being turned into rows by the editor
+    size_t workLen, workPos, workCap;
+    int done, error;
+};
+
+struct diffJob { // one diff of the rows against the saved file, run by diffThread
+    pthread_t thread;
+    unsigned int *rows, *saved; // line hashes
+    int numrows, numsaved;
+    int ownsSaved; // saved was replaced by a save while the job ran
+    int *base; // saved row of each row of the previous result, NULL to diff everything
+    int baseRows;
+    int from, to; // rows changed since base, rows before from are the same and rows after to moved by numrows - baseRows
+    int *match; // result: saved row of each row, -1 when added or changed
+    char *marks; // result: gutter marker of each row
+};
+
+struct trieNode { // identifiers of the buffer, shared prefixes shared
+    int parent, child, next; // first child and next sibling, 0 for none since the root is no one's child
+    int count; // rows' references to the identifier ending here
+    int best; // at least the largest count in the subtree, lowered lazily by lookups
+    char c;
+};
+
+struct undoRow { // a row as it was before a replace-all
+    int row, size;
+    char *chars;
+    int *shared;
+};
+
+struct cacheUse { // a row whose render and hl were needed at tick, queued oldest first for eviction
+    int row; // -1 once the row is deleted
+    unsigned int tick;
+};
+
+struct clipSpan { // part of a row's chars referenced by the clipboard, copied only when pasted into an edit
+    char *chars;
+    int *shared;
+    int off, len;
+};
+
 /*** global variables ***/
 struct configurations {
     int xCoord, yCoord;
     int rx;
     int rowOffset, colOffset;
+    int segOffset; // screen line of row[rowOffset] at the top while soft wrapping
+    int screenY, screenX; // where editorScroll put the cursor on screen
+    int softWrap; // this view wraps, other views of a shared buffer may not
+    int wrapCols; // width the rows are wrapped at, the one of the last wrapping view to take the buffer
+    int wrapViews; // views wrapping the buffer, rows keep their wraps up to date while there are any
     int terminalRows, terminalCols;
     int numrows;
+    int rowCap; // allocated slots in row
     editorRow *row;
     int dirty;// to know if the changes are saved or not
+    unsigned long edits; // bumped with dirty by every change but never reset, for state that goes stale on any edit
     char *fileName;
+    struct codec *codec; // compression of the file on disk, NULL when plain
+    struct fileLoader *loader; // non NULL while the file is still being read
+    int readError; // errno of a load that came up short, 0 when the whole file is in
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
+    struct symbol *symbols; // definitions sorted by row
+    int numsymbols, symbolCap;
+    struct rowNode *rowTree; // node 0 stands for no node, freed nodes are chained through left
+    int rowTreeRoot, rowTreeNodes, rowTreeCap, rowTreeFree;
+    unsigned int rowTreeSeed; // xorshift state for node priorities
+    struct textStats totals; // of every row, kept up to date by updateRender and deleteRows
+    int rowTreeStale; // row summaries changed behind the tree's back, reloaded before the next query
+    int bracketRow, bracketRx; // bracket under the cursor and its partner, in render columns
+    int matchRow, matchRx;
+    struct overlay overlays[OVERLAY_COUNT];
+    char *hlScratch; // one class per render column for the row being highlighted or scanned
+    int hlScratchSize;
+    char *renderScratch; // an evicted row's render while search reads it
+    int renderScratchSize;
+    int hlBatch; // set while highlightRows drives updateSyntax row by row
+    int selecting; // a selection runs from the mark to the cursor
+    int markX, markY;
+    struct clipSpan *clipboard; // one span per line
+    int clipLines;
+    int hlSuspended; // updateSyntax only widens the dirty range below, see resumeHighlighting
+    struct rowRange hlDirty;
+    int *macro; // keys recorded by readKey
+    int macroLen, macroCap;
+    int recording, replaying;
+    int replayPos;
+    struct undoRow *undo; // rows changed by the last replace-all, newest first
+    int undoRows;
+    unsigned long undoEdits; // edits right after that replace, any other edit makes the undo stale
+    unsigned int *savedHashes; // line hashes of the file as opened or last saved
+    int numSaved, savedCap;
+    int *diffMatch; // saved row of each row as of the last diff, NULL before the first one
+    int diffRows;
+    struct rowRange diffDirty; // rows changed since the last diff was started
+    int diffFull; // the saved side changed, so the next diff starts over
+    struct diffJob *diffJob; // running, NULL when idle
+    struct trieNode *trie; // node 0 is the root
+    int trieNodes, trieCap;
+    int trieFree; // first node on the free list, chained through next, 0 when empty
+    int identEpoch; // bumped when the syntax changes, so every row indexes again
+    char *completions[COMPLETION_MAX]; // shown in a popup while non empty
+    int numCompletions, completionSelected, completionPrefix;
+    int pendingKey; // handed out by readKey before anything else
+    long cacheBytes; // render and hl of every row, the part of the buffer that can be evicted
+    long indexBytes; // wrap points, identifier lists and symbol names of every row
+    unsigned int cacheTick; // bumped every frame
+    struct cacheUse *cacheQueue; // rows in the order their caches were needed, only kept under a budget
+    int cacheHead, cacheLen, cacheCap; // entries before cacheHead are done with
+    long trimAgainAt; // memory use a trim couldn't get under the budget from, no point trying below it
+    int inFd, outFd; // keys come from inFd and frames go to outFd, the terminal unless this is a shared client
+    int wakeFd; // read end of a shared client's wake pipe, -1 otherwise
+    int slot; // the client's place in server.wakeFds
+    int detached; // the client left, readKey hands out escapes until processKey returns
+    struct abuf *frame; // lines last sent to a shared client, NULL before the first frame
+    int framePopup; // the last frame had the completion popup over it
+    struct abuf *unsent; // a shared client's frames, sent once it lets go of the buffer, NULL otherwise
     struct termios originalTerminal;
 };
-struct configurations editor;
+__thread struct configurations editor; // per thread, so batch workers each edit their own file
+long memBudget; // bytes each buffer tries to stay under by evicting render and hl, 0 for no limit
 
 /***file types***/
 
@@ -102,7 +296,7 @@ struct editorSyntax HLDB[] = { // highlight database
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_INDEX_SYMBOLS
     },
     {
         "text",
@@ -115,6 +309,33 @@ struct editorSyntax HLDB[] = { // highlight database
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+/***compressed files***/
+struct codec {
+    char *name;
+    char *extension;
+    unsigned char magic[4];
+    int magicLen;
+    char *decompress[4]; // filters run as stdin -> stdout
+    char *compress[4];
+};
+struct codec CODECS[] = {
+    { "gzip", ".gz", {0x1f, 0x8b}, 2, {"gzip", "-dc", NULL}, {"gzip", "-c", NULL} },
+    { "zstd", ".zst", {0x28, 0xb5, 0x2f, 0xfd}, 4, {"zstd", "-dcq", NULL}, {"zstd", "-cq", NULL} }
+};
+
+#define CODEC_ENTRIES (sizeof(CODECS) / sizeof(CODECS[0]))
+
+struct codec *codecForExtension(char *ext) {
+    for (unsigned int j = 0; ext && j < CODEC_ENTRIES; j ++)
+        if (!strcmp(ext, CODECS[j].extension)) return &CODECS[j];
+    return NULL;
+}
+struct codec *codecForMagic(unsigned char *magic, int len) {
+    for (unsigned int j = 0; j < CODEC_ENTRIES; j ++)
+        if (len >= CODECS[j].magicLen && !memcmp(magic, CODECS[j].magic, CODECS[j].magicLen)) return &CODECS[j];
+    return NULL;
+}
+
 
 /*** append buffer ***/
 struct abuf {
@@ -154,7 +375,41 @@ int rxToxCoord(editorRow *row, int rx) {
 }
 void editorSetStatusMessage(const char *fmt, ...);
 char *prompt(char *message, void (*callback)(char *, int));
+void editorInsertChar(int c);
+char *promptInput(char *message, void (*callback)(char *, int), int allowEmpty);
 int colourCodes(int hl);
+int isCodeChar(char *hl, int at);
+int selectionOverlay(int fileRow, struct overlay *o);
+int getSelection(int *sy, int *sx, int *ey, int *ex);
+int selectionStats(struct textStats *out);
+int cursorPercent();
+void updateBracketMatch();
+void processKey();
+int loadPendingRows(int budgetMs);
+int diffPending();
+void indexRowIdents(editorRow *row, char *hl, int startsInComment);
+void drawCompletions(struct abuf *ab);
+int diffTick();
+void snapshotSaved();
+void initBuffer();
+void freeBuffer();
+void scrollWrapped();
+void waitShared();
+int otherClients();
+void drawFrameDiff(struct abuf *ab);
+void resizeView(int rows, int cols);
+void wrapRow(editorRow *row);
+void rowEnsureRender(editorRow *row);
+int rowCacheBytes(editorRow *row);
+void renderRow(editorRow *row);
+void highlightRow(editorRow *row, int inComment);
+void trimCaches();
+long memoryUse();
+void queueCacheUse(editorRow *row);
+void shiftCacheQueue(int at, int delta);
+void formatBytes(long bytes, char *out, int size);
+int wrapStart(editorRow *row, int seg);
+int wrapEnd(editorRow *row, int seg);
 
 /***output screen***/
  
@@ -163,6 +418,10 @@ void editorScroll() {
     if (editor.yCoord < editor.numrows) {
         editor.rx = xCoordTorx(&editor.row[editor.yCoord], editor.xCoord);
     }
+    if (editor.softWrap) {
+        scrollWrapped();
+        return;
+    }
 
     if (editor.yCoord < editor.rowOffset) {
         editor.rowOffset = editor.yCoord;
@@ -173,14 +432,86 @@ void editorScroll() {
     if (editor.rx < editor.colOffset) {
         editor.colOffset = editor.rx;
     }
-    if (editor.rx >= editor.colOffset + editor.terminalCols) {
-        editor.colOffset = editor.rx - editor.terminalCols + 1;
+    if (editor.rx >= editor.colOffset + TEXT_COLS) {
+        editor.colOffset = editor.rx - TEXT_COLS + 1;
+    }
+    editor.screenY = editor.yCoord - editor.rowOffset;
+    editor.screenX = editor.rx - editor.colOffset;
+}
+
+int isInverse(int hl) {
+    return hl == HL_BRACKET || hl == HL_SELECTION;
+}
+void appendRun(struct abuf *ab, char *c, int len, int hl, int *currentColour) { // one colour change, then bulk copies
+    if (isInverse(hl)) abAppend(ab, "\x1b[7m", 4);
+    else if (hl == HL_NORMAL) {
+        if (*currentColour != -1) {
+            abAppend(ab, "\x1b[39m", 5);
+            *currentColour = -1;
+        }
+    }
+    else if (colourCodes(hl) != *currentColour) {
+        *currentColour = colourCodes(hl);
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", *currentColour);
+        abAppend(ab, buf, clen);
+    }
+    int done = 0;
+    for (int j = 0; j < len; j ++) {
+        if (!iscntrl(c[j])) continue;
+        abAppend(ab, &c[done], j - done);
+        char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, &sym, 1);
+        abAppend(ab, "\x1b[m", 3);
+        if (*currentColour != -1) {
+            char buf[16];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", *currentColour);
+            abAppend(ab, buf, clen);
+        }
+        if (isInverse(hl)) abAppend(ab, "\x1b[7m", 4);
+        done = j + 1;
     }
+    abAppend(ab, &c[done], len - done);
+    if (isInverse(hl)) abAppend(ab, "\x1b[27m", 5);
 }
+void drawRowSegment(struct abuf *ab, int fileRow, int from, int len) { // render columns [from, from + len)
+    editorRow *row = &editor.row[fileRow];
+    rowEnsureRender(row);
+    struct overlay *overlays[OVERLAY_COUNT + 1];
+    int numOverlays = 0;
+    struct overlay selection;
+    if (selectionOverlay(fileRow, &selection)) overlays[numOverlays ++] = &selection;
+    for (int j = 0; j < OVERLAY_COUNT; j ++)
+        if (editor.overlays[j].row == fileRow) overlays[numOverlays ++] = &editor.overlays[j];
 
+    int currentColour = -1;
+    int span = 0, spanStart = 0;
+    int at = from, to = from + len;
+    while (at < to) {
+        while (span < row -> hlSpans && spanStart + row -> hl[span].len <= at) spanStart += row -> hl[span ++].len;
+        int hl = HL_NORMAL, end = to;
+        if (span < row -> hlSpans) {
+            hl = row -> hl[span].hl;
+            end = spanStart + row -> hl[span].len;
+        }
+        for (int j = 0; j < numOverlays; j ++) {
+            struct overlay *o = overlays[j];
+            if (at >= o -> start && at < o -> start + o -> len) {
+                hl = o -> hl;
+                if (o -> start + o -> len < end) end = o -> start + o -> len;
+            }
+            else if (o -> start > at && o -> start < end) end = o -> start;
+        }
+        if (end > to) end = to;
+        appendRun(ab, &row -> render[at], end - at, hl, &currentColour);
+        at = end;
+    }
+    abAppend(ab, "\x1b[39m", 5);
+}
 void indicateRows(struct abuf *ab) {
+    int fileRow = editor.rowOffset, seg = editor.softWrap ? editor.segOffset : 0;
     for (int currRow = 0; currRow < editor.terminalRows; currRow ++) {
-        int fileRow = currRow + editor.rowOffset;
         if (fileRow >= editor.numrows) {
             if (editor.numrows == 0 && currRow == editor.terminalRows / 3) {
                 char welcome[80];
@@ -197,45 +528,28 @@ void indicateRows(struct abuf *ab) {
             else {
                 abAppend(ab, "~", 1);//light blue
             }
+            fileRow ++;
         } 
         else {
-            int len = editor.row[fileRow].rsize - editor.colOffset;
-            if (len < 0) len = 0;
-            if (len > editor.terminalCols) len = editor.terminalCols;
-            char *c = &editor.row[fileRow].render[editor.colOffset];
-            char *hl = &editor.row[fileRow].hl[editor.colOffset];
-            int currentColour = -1;
-            for (int j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (currentColour != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColour);
-                        abAppend(ab, buf, clen);
-                    }
-                }
-                else  if (hl[j] == HL_NORMAL) {
-                    if (currentColour != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        currentColour = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } 
-                else {
-                    int colour = colourCodes(hl[j]);
-                    if (colour != currentColour) {
-                        currentColour = colour;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour);  
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
-                }   
+            editorRow *row = &editor.row[fileRow];
+            char mark = seg == 0 ? row -> diffMark : ' '; // wrapped lines go unmarked
+            if (mark == ' ') abAppend(ab, " ", 1);
+            else {
+                char buf[16];
+                abAppend(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%dm%c\x1b[39m", mark == '+' ? 32 : mark == '~' ? 33 : 31, mark));
             }
-            abAppend(ab, "\x1b[39m", 5);  
+            int from = editor.softWrap ? wrapStart(row, seg) : editor.colOffset;
+            int end = editor.softWrap ? wrapEnd(row, seg) : row -> rsize;
+            int len = end - from;
+            if (len < 0) len = 0;
+            if (len > TEXT_COLS) len = TEXT_COLS;
+            drawRowSegment(ab, fileRow, from, len);
+            struct overlay selection; // a selected line break shows as one highlighted blank
+            if (end == row -> rsize && selectionOverlay(fileRow, &selection) && selection.start + selection.len > row -> rsize &&
+                    row -> rsize >= from && row -> rsize - from < TEXT_COLS)
+                abAppend(ab, "\x1b[7m \x1b[27m", 10);
+            if (!editor.softWrap || ++ seg == row -> summary.height) seg = 0;
+            if (seg == 0) fileRow ++;
         }
         abAppend(ab, "\x1b[K", 3);
         abAppend(ab, "\r\n", 2);
@@ -243,11 +557,31 @@ void indicateRows(struct abuf *ab) {
 }
 void drawStatusBar(struct abuf *ab) {
     abAppend(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "\x1b[35m %.20s - %d lines %s\x1b[m", editor.fileName ? 
-                    editor.fileName : "[Unknown File]", editor.numrows, editor.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", editor.syntax ? 
-                    editor.syntax -> fileType : "no file type", editor.yCoord + 1, editor.numrows);    
+    char status[80], rstatus[160], used[16], budget[16] = "";
+    int len = snprintf(status, sizeof(status), "\x1b[35m %.20s - %d lines %s%s\x1b[m", editor.fileName ? 
+                    editor.fileName : "[Unknown File]", editor.numrows, editor.loader ? "(loading) " : editor.recording ? "(recording) " : "", editor.dirty ? "(modified)" : "");
+    struct textStats counts = editor.totals;
+    int selected = selectionStats(&counts);
+    formatBytes(memoryUse(), used, sizeof(used));
+    if (memBudget) {
+        budget[0] = '/';
+        formatBytes(memBudget, &budget[1], sizeof(budget) - 1);
+    }
+    // too wide to sit beside the left side, it loses mem, then bytes, chars, words, the percentage and the file type
+    int rlen = 0;
+    for (int drop = 0; drop < 7; drop ++) {
+        char *end = rstatus, *stop = rstatus + sizeof(rstatus);
+        if (selected && drop < 4) end += snprintf(end, stop - end, "sel ");
+        if (drop < 4) end += snprintf(end, stop - end, "%ldw ", counts.words);
+        if (drop < 3) end += snprintf(end, stop - end, "%ldc ", counts.chars);
+        if (drop < 2) end += snprintf(end, stop - end, "%ldB ", counts.bytes);
+        if (drop < 5) end += snprintf(end, stop - end, "%d%% | ", cursorPercent());
+        if (drop < 6) end += snprintf(end, stop - end, "%s | ", editor.syntax ? editor.syntax -> fileType : "no file type");
+        end += snprintf(end, stop - end, "%d/%d", editor.yCoord + 1, editor.numrows);
+        if (drop < 1) end += snprintf(end, stop - end, " | mem %s%s", used, budget);
+        rlen = end - rstatus;
+        if (len + rlen <= editor.terminalCols) break;
+    }
     if (len > editor.terminalCols) len = editor.terminalCols;
     if (len > editor.terminalCols) len = editor.terminalCols;
     abAppend(ab, status, len);
@@ -280,25 +614,33 @@ void drawMessageBar(struct abuf *ab) {
     if ( msgLen && time(NULL) - editor.statusmsg_time < 5) abAppend(ab, editor.statusmsg, msgLen);
 }
 void refreshScreen() {
+    if (editor.replaying) return; // one repaint once the macro is done
+    editor.cacheTick ++;
+    trimCaches();
     editorScroll();
+    updateBracketMatch();
 
     struct abuf ab = ABUF_INIT;
     
     abAppend(&ab, "\x1b[?25l", 6); // hide cursor
     //abAppend(&ab, "\x1b[2J", 4);
-    abAppend(&ab, "\x1b[H", 3);
-    
-    indicateRows(&ab);
-    drawStatusBar(&ab);
-    drawMessageBar(&ab);
+    if (editor.wakeFd != -1) drawFrameDiff(&ab);
+    else {
+        abAppend(&ab, "\x1b[H", 3);
+        indicateRows(&ab);
+        drawStatusBar(&ab);
+        drawMessageBar(&ab);
+        if (editor.numCompletions) drawCompletions(&ab);
+    }
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editor.yCoord - editor.rowOffset + 1, editor.rx - editor.colOffset + 1);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editor.screenY + 1, editor.screenX + 1 + GUTTER_COLS);
     abAppend(&ab, buf, strlen(buf));
 
     abAppend(&ab, "\x1b[?25h", 6); // show cursor
 
-    write(STDOUT_FILENO, ab.b, ab.len);
+    if (editor.unsent) abAppend(editor.unsent, ab.b, ab.len); // written by waitShared without the server lock
+    else write(editor.outFd, ab.b, ab.len);
     abFree(&ab);
 }
 
@@ -329,21 +671,59 @@ void enableRawMode() {
     if ( tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1 ) handleError("tcsetattr");
 } // function to enable raw mode
 
-int readKey() {
+int readSequenceByte(char *c) { // the rest of an escape sequence, giving up after a moment
+    if (editor.wakeFd != -1) { // a raw terminal times out by itself, a socket has to be polled
+        struct pollfd in = { editor.inFd, POLLIN, 0 };
+        if (poll(&in, 1, 100) != 1) return 0;
+    }
+    return read(editor.inFd, c, 1);
+}
+int readSequenceNumber(char end) { // digits up to end, -1 when something else comes
+    int n = 0;
+    char c;
+    while (readSequenceByte(&c) == 1) {
+        if (c == end) return n;
+        if (!isdigit(c) || n > 100000) return -1;
+        n = n * 10 + c - '0';
+    }
+    return -1;
+}
+int readTerminalKey() {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) handleError("read");
+    if (editor.detached) return '\x1b'; // unwinds any prompt the client was in
+    if (editor.wakeFd != -1) waitShared();
+    else while (editor.loader || diffPending()) { // keep filling rows and diffing until the user presses something
+        struct pollfd in = { editor.inFd, POLLIN, 0 };
+        if (poll(&in, 1, editor.loader ? 0 : 20) > 0) break;
+        if (editor.loader) loadPendingRows(30);
+        if (diffTick() || editor.loader) refreshScreen();
+    }
+    while ((nread = read(editor.inFd, &c, 1)) != 1) {
+        if (nread == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (editor.wakeFd != -1) { // the client hung up or its connection broke, the server goes on without it
+            editor.detached = 1;
+            return '\x1b';
+        }
+        if (nread == -1) handleError("read");
     }
     if (c == '\x1b') { //arrow keys have the escape sequence '\x1b' at the beginning
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (readSequenceByte(&seq[0]) != 1) return '\x1b';
+        if (readSequenceByte(&seq[1]) != 1) return '\x1b';
         
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if (readSequenceByte(&seq[2]) != 1) return '\x1b';
+                if (seq[1] == '8' && seq[2] == ';' && editor.wakeFd != -1) { // \x1b[8;ROWS;COLSt, a shared client's terminal was resized
+                    int rows = readSequenceNumber(';'), cols = rows == -1 ? -1 : readSequenceNumber('t');
+                    if (rows > 2 && cols > GUTTER_COLS) {
+                        resizeView(rows - 2, cols);
+                        refreshScreen();
+                    }
+                    return readTerminalKey();
+                }
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1': return HOME_KEY;
@@ -379,6 +759,23 @@ int readKey() {
         return c;
     }
 } //separate function because we 're processing it only after we read a valid key w/o errors
+int readKey() { // replays the macro or records into it
+    if (editor.pendingKey) {
+        int c = editor.pendingKey;
+        editor.pendingKey = 0;
+        return c;
+    }
+    if (editor.replaying) return editor.replayPos < editor.macroLen ? editor.macro[editor.replayPos ++] : '\x1b';
+    int c = readTerminalKey();
+    if (editor.recording) {
+        if (editor.macroLen == editor.macroCap) {
+            editor.macroCap = editor.macroCap ? editor.macroCap * 2 : 64;
+            editor.macro = realloc(editor.macro, sizeof(int) * editor.macroCap);
+        }
+        editor.macro[editor.macroLen ++] = c;
+    }
+    return c;
+}
 int getCursorPosition(int *rSize, int *cSize) {
     char buffer[32];
     unsigned int i = 0;
@@ -408,249 +805,1513 @@ int getWindowSize(int *rSize, int *cSize) {
     }
 }
 
-/*** syntax highlighting ***/
-int isSeparator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
-int colourCodes(int hl) {
-    switch (hl) {
-        case HL_MLCOMMENT:
-        case HL_COMMENT: return 36; //cyan
-        case HL_KEYWORD1: return 33; //Brown
-        case HL_KEYWORD2: return 32; // Green
-        case HL_NUMBER: return 31; //red
-        case HL_TEXT: return 33;
-        case HL_MATCH: return 32; //green // when we found the search results
-        case HL_STRING: return 34; //Blue
-        default: return 37;
+/*** highlight spans ***/
+char *hlScratch(int size) {
+    if (size > editor.hlScratchSize) {
+        editor.hlScratchSize = size * 2;
+        editor.hlScratch = realloc(editor.hlScratch, editor.hlScratchSize);
     }
+    return editor.hlScratch;
 }
-void updateSyntax(editorRow *row) {
-    row -> hl = realloc(row -> hl, row -> rsize);
-    memset(row -> hl, HL_NORMAL, row -> rsize);
+void encodeSpans(editorRow *row, char *hl) {
+    int end = row -> rsize;
+    while (end > 0 && hl[end - 1] == HL_NORMAL) end --;
 
-    if (editor.syntax == NULL) return;
-
-    char **keywords = editor.syntax -> keywords;
+    int count = 0;
+    for (int j = 0; j < end; ) {
+        int k = j + 1;
+        while (k < end && hl[k] == hl[j] && k - j < HL_SPAN_MAX) k ++;
+        count ++;
+        j = k;
+    }
+    if (count != row -> hlSpans) {
+        editor.cacheBytes += (long) (count - row -> hlSpans) * sizeof(struct hlSpan);
+        free(row -> hl);
+        row -> hl = count ? malloc(sizeof(struct hlSpan) * count) : NULL;
+        row -> hlSpans = count;
+    }
+    count = 0;
+    for (int j = 0; j < end; ) {
+        int k = j + 1;
+        while (k < end && hl[k] == hl[j] && k - j < HL_SPAN_MAX) k ++;
+        row -> hl[count].len = k - j;
+        row -> hl[count ++].hl = hl[j];
+        j = k;
+    }
+}
+char *expandSpans(editorRow *row) { // per column classes of row, valid until the next hlScratch user
+    rowEnsureRender(row);
+    char *hl = hlScratch(row -> rsize + 1);
+    int at = 0;
+    for (int j = 0; j < row -> hlSpans; j ++) {
+        memset(&hl[at], row -> hl[j].hl, row -> hl[j].len);
+        at += row -> hl[j].len;
+    }
+    memset(&hl[at], HL_NORMAL, row -> rsize - at);
+    return hl;
+}
+int isCodeChar(char *hl, int at) { // comments and strings aren't code
+    return hl[at] != HL_COMMENT && hl[at] != HL_MLCOMMENT && hl[at] != HL_STRING;
+}
 
-    char *scStart = editor.syntax -> singleLineCommentStart;
-    char *mcStart = editor.syntax -> multiLineCommentsStart;
-    char *mcEnd = editor.syntax -> multiLineCommentsEnd;
+/*** symbol index ***/
+#define SYMBOL_MAX_TOKENS 16
 
-    int scStartLen = scStart ? strlen(scStart) : 0;
-    int mcStartLen = mcStart ? strlen(mcStart) : 0;
-    int mcEndLen = mcEnd ? strlen(mcEnd) : 0;
+char *symbolKindNames[] = { "function", "struct", "union", "enum", "typedef" };
 
-    int prevSeperator = 1;
-    int inString = 0;
-    int inComment = (row -> index > 0 && editor.row[row -> index - 1].hlOpenComment);
+int symbolLowerBound(int row) { // first symbol at or after row (binary search)
+    int lo = 0, hi = editor.numsymbols;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (editor.symbols[mid].row < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+void removeSymbolRange(int fromRow, int toRow) { // rows [fromRow, toRow)
+    int from = symbolLowerBound(fromRow);
+    int to = from;
+    while (to < editor.numsymbols && editor.symbols[to].row < toRow) {
+        editor.indexBytes -= strlen(editor.symbols[to].name) + 1;
+        free(editor.symbols[to ++].name);
+    }
+    if (to == from) return;
+    memmove(&editor.symbols[from], &editor.symbols[to], sizeof(struct symbol) * (editor.numsymbols - to));
+    editor.numsymbols -= to - from;
+}
+void removeRowSymbols(int row) {
+    removeSymbolRange(row, row + 1);
+}
+void shiftSymbols(int fromRow, int delta) { // rows were inserted or deleted at fromRow
+    for (int j = symbolLowerBound(fromRow); j < editor.numsymbols; j ++) editor.symbols[j].row += delta;
+}
+void clearSymbols() {
+    for (int j = 0; j < editor.numsymbols; j ++) {
+        editor.indexBytes -= strlen(editor.symbols[j].name) + 1;
+        free(editor.symbols[j].name);
+    }
+    editor.numsymbols = 0;
+}
+void addSymbol(editorRow *row, int start, int len, int kind) {
+    if (editor.numsymbols == editor.symbolCap) {
+        editor.symbolCap = editor.symbolCap ? editor.symbolCap * 2 : 64;
+        editor.symbols = realloc(editor.symbols, sizeof(struct symbol) * editor.symbolCap);
+    }
+    int at = symbolLowerBound(row -> index + 1);
+    memmove(&editor.symbols[at + 1], &editor.symbols[at], sizeof(struct symbol) * (editor.numsymbols - at));
+    editor.symbols[at].name = strndup(&row -> render[start], len);
+    editor.indexBytes += len + 1;
+    editor.symbols[at].kind = kind;
+    editor.symbols[at].row = row -> index;
+    editor.symbols[at].rx = start;
+    editor.numsymbols ++;
+}
+int isIdentChar(int c) {
+    return isalnum(c) || c == '_';
+}
+int tokenIs(editorRow *row, int start, int len, char *word) {
+    return (int)strlen(word) == len && !strncmp(&row -> render[start], word, len);
+}
+int findRowSymbol(editorRow *row, char *hl, int *symStart, int *symLen) { // kind of the definition on row or -1, skipping comments and strings via hl
+    if (editor.syntax == NULL || !(editor.syntax -> flags & HL_INDEX_SYMBOLS)) return -1;
+    if (row -> rsize == 0 || isspace(row -> render[0]) || row -> render[0] == '#') return -1;
 
+    // tokens are either identifiers (len > 0) or a single punctuation char (len == 0)
+    int start[SYMBOL_MAX_TOKENS], len[SYMBOL_MAX_TOKENS];
+    int n = 0, lastChar = 0;
     int i = 0;
-    while (i < row->rsize) {
+    while (i < row -> rsize) {
         char c = row -> render[i];
-        char prevhl = (1 > 0) ? row -> hl[i - 1] : HL_NORMAL;
-        
-        if (scStartLen && !inString && !inComment) {
-            if (!strncmp(&row->render[i], scStart, scStartLen)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
+        if (!isCodeChar(hl, i) || isspace(c)) {
+            i ++;
+            continue;
         }
-
-        if (mcStartLen && mcEndLen && !inString) {
-            if (inComment) {
-                row -> hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row -> render[i], mcEnd, mcEndLen)) {
-                    memset(&row -> hl[i], HL_MLCOMMENT, mcEndLen);
-                    i += mcEndLen;
-                    inComment = 0;
-                    prevSeperator = 1;
-                    continue;
-                } 
-                else {
-                    i ++;
-                    continue;
-                }
-            } 
-            else if (!strncmp(&row -> render[i], mcStart, mcStartLen)) {
-                memset(&row ->hl[i], HL_MLCOMMENT, mcStartLen);
-                i += mcStartLen;
-                inComment = 1;
-                continue;
+        lastChar = c;
+        if (isalpha(c) || c == '_') {
+            int j = i;
+            while (j < row -> rsize && isIdentChar(row -> render[j])) j ++;
+            if (n < SYMBOL_MAX_TOKENS) {
+                start[n] = i;
+                len[n ++] = j - i;
             }
+            lastChar = 'a';
+            i = j;
+            continue;
         }
-
-        if (editor.syntax -> flags & HL_HIGHLIGHT_STRINGS) {
-            if (inString) {
-                row -> hl[i] = HL_STRING;
-            if (c == '\\' && i + 1 < row -> rsize) {
-                row -> hl[i + 1] = HL_STRING;
-                i += 2;
-                continue;
-            }
-            if (c == inString) inString = 0;
-                i ++;
-                prevSeperator = 1;
-                continue;
-            } 
-            else {
-                if (c == '"' || c == '\'') {
-                    inString = c;
-                    row -> hl[i] = HL_STRING;
-                    i ++;
-                    continue;
-                }
-            }
+        if (strchr("(){};=*", c) && n < SYMBOL_MAX_TOKENS) {
+            start[n] = i;
+            len[n ++] = 0;
         }
+        i ++;
+    }
+    if (n == 0) return -1;
 
-        if (editor.syntax -> flags & HL_HIGHLIGHT_NUMBERS) {
-            if ( (isdigit(c) && (prevSeperator || prevhl == HL_NUMBER)) || (c == '.' && prevhl == HL_NUMBER)) { //decimal numbers also
-                row -> hl[i] = HL_NUMBER;
-                i ++;
-                prevSeperator = 0;
-                continue;
-            }
-        }
-        if (editor.syntax -> flags & HL_HIGHLIGHT_TEXT) {
-            row -> hl[i] = HL_TEXT;
+    #define PUNCT(k, ch) ((k) < n && len[k] == 0 && row -> render[start[k]] == (ch))
+    #define IDENT(k) ((k) < n && len[k] > 0)
+
+    if (PUNCT(0, '}') && IDENT(1) && PUNCT(2, ';') && n == 3) { // } name; closing a typedef
+        *symStart = start[1];
+        *symLen = len[1];
+        return SYM_TYPEDEF;
+    }
+    int k = 0, isTypedef = 0;
+    if (IDENT(0) && tokenIs(row, start[0], len[0], "typedef")) {
+        isTypedef = 1;
+        k = 1;
+    }
+    if (IDENT(k) && IDENT(k + 1) && (k + 2 == n || PUNCT(k + 2, '{'))) {
+        int kind = -1;
+        if (tokenIs(row, start[k], len[k], "struct")) kind = SYM_STRUCT;
+        else if (tokenIs(row, start[k], len[k], "union")) kind = SYM_UNION;
+        else if (tokenIs(row, start[k], len[k], "enum")) kind = SYM_ENUM;
+        if (kind != -1) {
+            *symStart = start[k + 1];
+            *symLen = len[k + 1];
+            return kind;
         }
-        if (prevSeperator) {
-            int j;
-            for ( j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int keword2 = keywords[j][klen - 1] == '|';
-                
-                if (keword2) klen --;
-                if (!strncmp(&row->render[i], keywords[j], klen) && isSeparator(row->render[i + klen])) {
-                    memset(&row->hl[i], keword2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prevSeperator = 0;
-                continue;
+    }
+    if (isTypedef) {
+        if (lastChar != ';') return -1;
+        int name = -1;
+        for (int j = 1; j < n; j ++) {
+            if (PUNCT(j - 1, '*') && IDENT(j) && PUNCT(j + 1, ')')) { // typedef int (*name)(...);
+                name = j;
+                break;
             }
+            if (IDENT(j)) name = j;
         }
-        prevSeperator = isSeparator(c);
-        i ++;
+        if (name == -1) return -1;
+        *symStart = start[name];
+        *symLen = len[name];
+        return SYM_TYPEDEF;
     }
-    
-    int changed = (row -> hlOpenComment != inComment);
-    row -> hlOpenComment = inComment;
-    if (changed && row -> index + 1 < editor.numrows)
-        updateSyntax(&editor.row[row -> index + 1]);
-}
-void selectSyntaxHighlight() {
-    editor.syntax = NULL;
-    if (editor.fileName == NULL) return;
-    
-    char *ext = strrchr(editor.fileName, '.');
-    
-    for (int entry = 0; entry < HLDB_ENTRIES; entry ++) {
-        struct editorSyntax *s = &HLDB[entry];
-        int i = 0;
-        while (s -> fileMatch[i]) {
-            int isExtension = (s -> fileMatch[i][0] == '.');
-            if ((isExtension && ext && !strcmp(ext, s -> fileMatch[i])) || (!isExtension && strstr(editor.fileName, s -> fileMatch[i]))) {
-                editor.syntax = s;
-                
-                for ( int fileRow = 0; fileRow < editor.numrows; fileRow ++) {
-                    updateSyntax(&editor.row[fileRow]);
-                }
 
-                return;
-            }
-            i++;
+    // function definitions start in column 0 and don't end in ';' like prototypes do
+    if (!IDENT(0) || lastChar == ';') return -1;
+    char *notTypes[] = { "if", "else", "while", "for", "do", "switch", "return", "case", "goto", NULL };
+    for (int j = 0; notTypes[j]; j ++)
+        if (tokenIs(row, start[0], len[0], notTypes[j])) return -1;
+    for (int j = 2; j < n; j ++) {
+        if (PUNCT(j - 1, '=')) return -1;
+        if (PUNCT(j, '(') && IDENT(j - 1)) {
+            *symStart = start[j - 1];
+            *symLen = len[j - 1];
+            return SYM_FUNCTION;
         }
     }
+    return -1;
+    #undef PUNCT
+    #undef IDENT
 }
-
-/***manipulating row actions***/
-void updateRow(editorRow *row) {
-    free(row->render);
-    row->render = malloc(row->size + 1);
-    int index = 0, tabs = 0;
-    
-    for (int j = 0; j < row -> size; j ++) {
-        if (row -> chars[j] == '\t') tabs ++;
+void indexRowSymbols(editorRow *row, char *hl) { // a row defines at most one symbol, updated in place when it's unchanged
+    int start, len;
+    int kind = findRowSymbol(row, hl, &start, &len);
+    int at = symbolLowerBound(row -> index);
+    int had = (at < editor.numsymbols && editor.symbols[at].row == row -> index);
+    if (kind == -1) {
+        if (had) removeRowSymbols(row -> index);
+        return;
     }
-
-    free(row -> render);
-    row -> render = malloc(row -> size + tabs * (TAB_STOP - 1) + 1);
-
-    for (int j = 0; j < row -> size; j ++) {
-        if (row->chars[j] == '\t') {
-            row->render[index ++] = ' ';
-            while (index % TAB_STOP != 0) row->render[index ++] = ' ';
-        } 
-        else row->render[index ++] = row-> chars[j];
+    if (!had) {
+        addSymbol(row, start, len, kind);
+        return;
     }
-    row -> render[index] = '\0';
-    row -> rsize = index;
-    updateSyntax(row);
+    struct symbol *sym = &editor.symbols[at];
+    if ((int)strlen(sym -> name) != len || strncmp(sym -> name, &row -> render[start], len)) {
+        editor.indexBytes += len - (long) strlen(sym -> name);
+        free(sym -> name);
+        sym -> name = strndup(&row -> render[start], len);
+    }
+    sym -> kind = kind;
+    sym -> rx = start;
 }
-void insertRow(int insertAt, char *s, size_t len) {
-    if ( insertAt < 0 || insertAt > editor.numrows) return; 
-    
-    editor.row = realloc(editor.row, sizeof(editorRow) * (editor.numrows + 1));
-    memmove(&editor.row[insertAt + 1], &editor.row[insertAt], sizeof(editorRow) * (editor.numrows - insertAt));
-    for (int j = insertAt + 1; j <= editor.numrows; j ++) editor.row[j].index ++;
-    
-    editor.row[insertAt].index = insertAt;
 
-    editor.row[insertAt].size = len;
-    editor.row[insertAt].chars = malloc(len + 1);
-    memcpy(editor.row[insertAt].chars, s, len);
-    editor.row[insertAt].chars[len] = '\0';
+/*** bracket matching ***/
+char *openBrackets = "([{";
+char *closeBrackets = ")]}";
 
-    editor.row[insertAt].rsize = 0;
-    editor.row[insertAt].render = NULL;
-    editor.row[insertAt].hl = NULL;
-    editor.row[insertAt].hlOpenComment = 0;
-    updateRow(&editor.row[insertAt]);
-    editor.numrows ++;
-    editor.dirty ++;
-}
+int bracketKind(char c, int *open) {
+    if (c == '\0') return -1;
+    char *p = strchr(openBrackets, c);
+    if (p) {
+        *open = 1;
+        return p - openBrackets;
+    }
+    p = strchr(closeBrackets, c);
+    if (p) {
+        *open = 0;
+        return p - closeBrackets;
+    }
+    return -1;
+}
+void combineSummary(struct rowSummary *out, struct rowSummary *a, struct rowSummary *b) {
+    for (int k = 0; k < BRACKET_KINDS; k ++) {
+        int net = a -> brackets[k].net + b -> brackets[k].net;
+        int viaB = a -> brackets[k].net + b -> brackets[k].minPrefix;
+        out -> brackets[k].minPrefix = a -> brackets[k].minPrefix < viaB ? a -> brackets[k].minPrefix : viaB;
+        out -> brackets[k].net = net;
+    }
+    out -> words = a -> words + b -> words;
+    out -> chars = a -> chars + b -> chars;
+    out -> bytes = a -> bytes + b -> bytes;
+    out -> height = a -> height + b -> height;
+}
+void pullNode(int n) { // recombines a node from its children
+    struct rowNode *node = &editor.rowTree[n];
+    struct rowSummary withLeft;
+    combineSummary(&withLeft, &editor.rowTree[node -> left].sum, &node -> row);
+    combineSummary(&node -> sum, &withLeft, &editor.rowTree[node -> right].sum);
+    node -> size = editor.rowTree[node -> left].size + 1 + editor.rowTree[node -> right].size;
+}
+int newRowNode() { // a leaf with an empty summary
+    editor.rowTreeSeed ^= editor.rowTreeSeed << 13;
+    editor.rowTreeSeed ^= editor.rowTreeSeed >> 17;
+    editor.rowTreeSeed ^= editor.rowTreeSeed << 5;
+    int n;
+    if (editor.rowTreeFree) {
+        n = editor.rowTreeFree;
+        editor.rowTreeFree = editor.rowTree[n].left;
+    }
+    else {
+        if (editor.rowTreeNodes == editor.rowTreeCap) {
+            editor.rowTreeCap = editor.rowTreeCap ? editor.rowTreeCap * 2 : 1024;
+            editor.rowTree = realloc(editor.rowTree, sizeof(struct rowNode) * editor.rowTreeCap);
+            if (editor.rowTreeNodes == 0) { // the empty node every missing child points at
+                memset(&editor.rowTree[0], 0, sizeof(struct rowNode));
+                editor.rowTreeNodes = 1;
+            }
+        }
+        n = editor.rowTreeNodes ++;
+    }
+    memset(&editor.rowTree[n], 0, sizeof(struct rowNode));
+    editor.rowTree[n].size = 1;
+    editor.rowTree[n].priority = editor.rowTreeSeed;
+    return n;
+}
+int rowTreeRows() { // the tree covers rows [0, rowTreeRows()), rows appended after it wait for rowTreeReady
+    return editor.rowTreeRoot ? editor.rowTree[editor.rowTreeRoot].size : 0;
+}
+void splitRows(int n, int count, int *left, int *right) { // the first count rows of subtree n, and the rest
+    if (n == 0) {
+        *left = *right = 0;
+        return;
+    }
+    struct rowNode *node = &editor.rowTree[n];
+    if (editor.rowTree[node -> left].size >= count) {
+        splitRows(node -> left, count, left, &node -> left);
+        *right = n;
+    }
+    else {
+        splitRows(node -> right, count - editor.rowTree[node -> left].size - 1, &node -> right, right);
+        *left = n;
+    }
+    pullNode(n);
+}
+int mergeRows(int a, int b) { // every row of a goes before every row of b
+    if (a == 0 || b == 0) return a ? a : b;
+    if (editor.rowTree[a].priority > editor.rowTree[b].priority) {
+        editor.rowTree[a].right = mergeRows(editor.rowTree[a].right, b);
+        pullNode(a);
+        return a;
+    }
+    editor.rowTree[b].left = mergeRows(a, editor.rowTree[b].left);
+    pullNode(b);
+    return b;
+}
+void rowTreeInsert(int at, int count) { // count empty rows at at, their summaries come in through rowTreeUpdate
+    if (at >= rowTreeRows()) return; // past the end, like the loader's rows, they go in with the next query
+    int middle = 0, left, right;
+    for (int j = 0; j < count; j ++) {
+        int n = newRowNode();
+        middle = mergeRows(middle, n);
+    }
+    splitRows(editor.rowTreeRoot, at, &left, &right);
+    editor.rowTreeRoot = mergeRows(mergeRows(left, middle), right);
+}
+void freeRowNodes(int n) {
+    if (n == 0) return;
+    freeRowNodes(editor.rowTree[n].left);
+    freeRowNodes(editor.rowTree[n].right);
+    editor.rowTree[n].left = editor.rowTreeFree;
+    editor.rowTreeFree = n;
+}
+void rowTreeRemove(int at, int count) {
+    if (at >= rowTreeRows()) return;
+    int left, middle, right;
+    splitRows(editor.rowTreeRoot, at, &left, &middle);
+    splitRows(middle, count, &middle, &right);
+    freeRowNodes(middle);
+    editor.rowTreeRoot = mergeRows(left, right);
+}
+int reloadRowNodes(int n, int at) { // subtree n, whose first row is at, takes the rows' summaries again
+    if (n == 0) return at;
+    at = reloadRowNodes(editor.rowTree[n].left, at);
+    editor.rowTree[n].row = editor.row[at].summary;
+    at = reloadRowNodes(editor.rowTree[n].right, at + 1);
+    pullNode(n);
+    return at;
+}
+void appendRowNodes() { // rows past the tree go in as one subtree built left to right in O(rows), then a single merge
+    int from = rowTreeRows(), top = 0;
+    if (from >= editor.numrows) return;
+    int *spine = malloc(sizeof(int) * (editor.numrows - from)); // right edge of the subtree so far
+    for (int j = from; j < editor.numrows; j ++) {
+        int n = newRowNode(), below = 0;
+        editor.rowTree[n].row = editor.row[j].summary;
+        while (top && editor.rowTree[spine[top - 1]].priority < editor.rowTree[n].priority) {
+            below = spine[-- top];
+            pullNode(below);
+        }
+        editor.rowTree[n].left = below;
+        if (top) editor.rowTree[spine[top - 1]].right = n;
+        spine[top ++] = n;
+    }
+    while (top > 1) pullNode(spine[-- top]);
+    pullNode(spine[0]);
+    editor.rowTreeRoot = mergeRows(editor.rowTreeRoot, spine[0]);
+    free(spine);
+}
+void rowTreeReady() { // before a query
+    if (editor.rowTreeStale) reloadRowNodes(editor.rowTreeRoot, 0);
+    editor.rowTreeStale = 0;
+    appendRowNodes();
+}
+void setRowNode(int n, int at, struct rowSummary *summary) {
+    int left = editor.rowTree[editor.rowTree[n].left].size;
+    if (at < left) setRowNode(editor.rowTree[n].left, at, summary);
+    else if (at > left) setRowNode(editor.rowTree[n].right, at - left - 1, summary);
+    else editor.rowTree[n].row = *summary;
+    pullNode(n);
+}
+void rowTreeUpdate(int at) { // O(log n), down to the row and recombining on the way back up
+    if (editor.rowTreeStale || at >= rowTreeRows()) return;
+    setRowNode(editor.rowTreeRoot, at, &editor.row[at].summary);
+}
+void rowTreeRange(int n, int from, int to, struct rowSummary *out) { // combines rows [from, to) of subtree n onto out
+    if (n == 0 || from >= to || to <= 0 || from >= editor.rowTree[n].size) return;
+    struct rowNode *node = &editor.rowTree[n];
+    struct rowSummary before = *out;
+    if (from <= 0 && to >= node -> size) {
+        combineSummary(out, &before, &node -> sum);
+        return;
+    }
+    int left = editor.rowTree[node -> left].size;
+    rowTreeRange(node -> left, from, to, out);
+    if (from <= left && left < to) {
+        before = *out;
+        combineSummary(out, &before, &node -> row);
+    }
+    rowTreeRange(node -> right, from - left - 1, to - left - 1, out);
+}
+void summarizeRow(editorRow *row, char *hl) {
+    memset(row -> summary.brackets, 0, sizeof(row -> summary.brackets));
+    for (int j = 0; j < row -> rsize; j ++) {
+        int open;
+        int k = bracketKind(row -> render[j], &open);
+        if (k == -1 || !isCodeChar(hl, j)) continue;
+        struct bracketDepth *d = &row -> summary.brackets[k];
+        d -> net += open ? 1 : -1;
+        if (d -> net < d -> minPrefix) d -> minPrefix = d -> net;
+    }
+    rowTreeUpdate(row -> index);
+}
+int scanRowForward(editorRow *row, int from, int kind, int *depth) { // column where depth drops below 0, or -1
+    char *hl = expandSpans(row);
+    for (int j = from; j < row -> rsize; j ++) {
+        int open;
+        if (bracketKind(row -> render[j], &open) != kind || !isCodeChar(hl, j)) continue;
+        *depth += open ? 1 : -1;
+        if (*depth < 0) return j;
+    }
+    return -1;
+}
+int scanRowBackward(editorRow *row, int from, int kind, int *depth) {
+    char *hl = expandSpans(row);
+    for (int j = from; j >= 0; j --) {
+        int open;
+        if (bracketKind(row -> render[j], &open) != kind || !isCodeChar(hl, j)) continue;
+        *depth += open ? -1 : 1;
+        if (*depth < 0) return j;
+    }
+    return -1;
+}
+int findForward(int n, int from, int kind, int *depth) { // findRowForward within subtree n, rows counted from its first
+    if (n == 0 || from >= editor.rowTree[n].size) return -1;
+    struct rowNode *node = &editor.rowTree[n];
+    struct bracketDepth *d = &node -> sum.brackets[kind];
+    if (from <= 0 && *depth + d -> minPrefix >= 0) {
+        *depth += d -> net;
+        return -1;
+    }
+    int left = editor.rowTree[node -> left].size;
+    int found = findForward(node -> left, from, kind, depth);
+    if (found != -1) return found;
+    if (from <= left) {
+        d = &node -> row.brackets[kind];
+        if (*depth + d -> minPrefix < 0) return left;
+        *depth += d -> net;
+    }
+    found = findForward(node -> right, from - left - 1, kind, depth);
+    return found == -1 ? -1 : found + left + 1;
+}
+int findBackward(int n, int to, int kind, int *depth) { // findRowBackward over the rows before to in subtree n
+    if (n == 0 || to <= 0) return -1;
+    struct rowNode *node = &editor.rowTree[n];
+    struct bracketDepth *d = &node -> sum.brackets[kind];
+    if (to >= node -> size && d -> net - d -> minPrefix <= *depth) { // largest suffix sum doesn't reach depth + 1
+        *depth -= d -> net;
+        return -1;
+    }
+    int left = editor.rowTree[node -> left].size;
+    int found = findBackward(node -> right, to - left - 1, kind, depth);
+    if (found != -1) return found + left + 1;
+    if (to > left) {
+        d = &node -> row.brackets[kind];
+        if (d -> net - d -> minPrefix > *depth) return left;
+        *depth -= d -> net;
+    }
+    return findBackward(node -> left, to, kind, depth);
+}
+int findRowForward(int from, int kind, int *depth) { // first row >= from where the open bracket closes
+    if (from >= editor.numrows) return -1;
+    return findForward(editor.rowTreeRoot, from, kind, depth);
+}
+int findRowBackward(int from, int kind, int *depth) { // last row <= from where the close bracket opens
+    if (from < 0) return -1;
+    return findBackward(editor.rowTreeRoot, from + 1, kind, depth);
+}
+void updateBracketMatch() {
+    editor.bracketRow = editor.matchRow = -1;
+    editor.overlays[OVERLAY_BRACKET].row = editor.overlays[OVERLAY_PARTNER].row = -1;
+    if (editor.yCoord >= editor.numrows) return;
+    editorRow *row = &editor.row[editor.yCoord];
+    char *hl = expandSpans(row);
+
+    int at = editor.rx, open;
+    int kind = (at < row -> rsize) ? bracketKind(row -> render[at], &open) : -1;
+    if (kind == -1 || !isCodeChar(hl, at)) {
+        at = editor.rx - 1;
+        if (at < 0 || at >= row -> rsize) return;
+        kind = bracketKind(row -> render[at], &open);
+        if (kind == -1 || !isCodeChar(hl, at)) return;
+    }
+    rowTreeReady();
+
+    int depth = 0, matchRow = editor.yCoord, matchRx;
+    if (open) {
+        matchRx = scanRowForward(row, at + 1, kind, &depth);
+        if (matchRx == -1) {
+            matchRow = findRowForward(editor.yCoord + 1, kind, &depth);
+            if (matchRow == -1) return;
+            matchRx = scanRowForward(&editor.row[matchRow], 0, kind, &depth);
+        }
+    }
+    else {
+        matchRx = scanRowBackward(row, at - 1, kind, &depth);
+        if (matchRx == -1) {
+            matchRow = findRowBackward(editor.yCoord - 1, kind, &depth);
+            if (matchRow == -1) return;
+            matchRx = scanRowBackward(&editor.row[matchRow], editor.row[matchRow].rsize - 1, kind, &depth);
+        }
+    }
+    if (matchRx == -1) return;
+    editor.bracketRow = editor.yCoord;
+    editor.bracketRx = at;
+    editor.matchRow = matchRow;
+    editor.matchRx = matchRx;
+    struct overlay bracket = { editor.bracketRow, at, 1, HL_BRACKET };
+    struct overlay partner = { matchRow, matchRx, 1, HL_BRACKET };
+    editor.overlays[OVERLAY_BRACKET] = bracket;
+    editor.overlays[OVERLAY_PARTNER] = partner;
+}
+
+/*** document statistics ***/
+void countText(char *s, int len, struct textStats *out) { // words as wc counts them, chars as UTF-8 code points
+    int inWord = 0;
+    for (int j = 0; j < len; j ++) {
+        unsigned char c = s[j];
+        if ((c & 0xC0) != 0x80) out -> chars ++;
+        if (isspace(c)) inWord = 0;
+        else if (!inWord) {
+            inWord = 1;
+            out -> words ++;
+        }
+    }
+    out -> bytes += len;
+}
+void countRow(editorRow *row) { // after chars changed, keeps the totals and the row tree in step
+    editor.totals.words -= row -> summary.words;
+    editor.totals.chars -= row -> summary.chars;
+    editor.totals.bytes -= row -> summary.bytes;
+    struct textStats counts = { 0, 0, 1 };
+    countText(row -> chars, row -> size, &counts);
+    row -> summary.words = counts.words;
+    row -> summary.chars = counts.chars + 1;
+    row -> summary.bytes = counts.bytes;
+    editor.totals.words += row -> summary.words;
+    editor.totals.chars += row -> summary.chars;
+    editor.totals.bytes += row -> summary.bytes;
+    rowTreeUpdate(row -> index);
+}
+void uncountRow(editorRow *row) {
+    editor.totals.words -= row -> summary.words;
+    editor.totals.chars -= row -> summary.chars;
+    editor.totals.bytes -= row -> summary.bytes;
+}
+void rowTreeSum(int from, int to, struct textStats *out) { // adds the counts of rows [from, to)
+    if (from >= to) return;
+    rowTreeReady();
+    struct rowSummary range = { 0 };
+    rowTreeRange(editor.rowTreeRoot, from, to, &range);
+    out -> words += range.words;
+    out -> chars += range.chars;
+    out -> bytes += range.bytes;
+}
+int selectionStats(struct textStats *out) { // 0 when nothing is selected
+    int sy, sx, ey, ex;
+    if (!getSelection(&sy, &sx, &ey, &ex)) return 0;
+    memset(out, 0, sizeof(*out));
+    if (sy == ey) {
+        countText(&editor.row[sy].chars[sx], ex - sx, out);
+        return 1;
+    }
+    countText(&editor.row[sy].chars[sx], editor.row[sy].size - sx, out);
+    rowTreeSum(sy + 1, ey, out);
+    countText(editor.row[ey].chars, ex, out);
+    out -> chars += 1; // the first row's line break, the middle rows carry their own
+    out -> bytes += 1;
+    return 1;
+}
+int cursorPercent() { // position as a share of the bytes
+    if (editor.totals.bytes == 0) return 0;
+    struct textStats before = { 0, 0, 0 };
+    rowTreeSum(0, editor.yCoord < editor.numrows ? editor.yCoord : editor.numrows, &before);
+    if (editor.yCoord < editor.numrows) before.bytes += editor.xCoord;
+    return (int) (before.bytes * 100 / editor.totals.bytes);
+}
+
+/*** soft wrap ***/
+void wrapRow(editorRow *row) { // finds where the row breaks at the current width, the row tree is left to the caller
+    if (editor.wrapViews == 0 || editor.wrapCols < 1) return;
+    if (row -> wrapWidth == editor.wrapCols) return;
+    if (row -> wraps) editor.indexBytes -= (long) (row -> summary.height - 1) * sizeof(int);
+    free(row -> wraps);
+    row -> wraps = NULL;
+    int width = editor.wrapCols, numWraps = 0, cap = 0;
+    int start = 0, afterSpace = -1, rx = 0;
+    // breaks only fall between chars, so a tab is never split, and after a blank when there is one
+    for (int j = 0; j <= row -> size; ) {
+        int w = j == row -> size ? 1 : row -> chars[j] == '\t' ? TAB_STOP - rx % TAB_STOP : 1; // the end holds the cursor
+        if (rx + w - start > width && rx > start) {
+            int at = afterSpace > start ? afterSpace : rx;
+            if (numWraps == cap) {
+                cap = cap ? cap * 2 : 4;
+                row -> wraps = realloc(row -> wraps, sizeof(int) * cap);
+            }
+            row -> wraps[numWraps ++] = at;
+            start = at;
+            afterSpace = -1;
+            continue;
+        }
+        if (j == row -> size) break;
+        rx += w;
+        if (row -> chars[j] == ' ' || row -> chars[j] == '\t') afterSpace = rx;
+        j ++;
+    }
+    row -> summary.height = numWraps + 1;
+    row -> wrapWidth = width;
+    editor.indexBytes += (long) numWraps * sizeof(int);
+}
+int wrapStart(editorRow *row, int seg) {
+    return seg == 0 ? 0 : row -> wraps[seg - 1];
+}
+int wrapEnd(editorRow *row, int seg) {
+    return seg == row -> summary.height - 1 ? row -> rsize : row -> wraps[seg];
+}
+int wrapSegment(editorRow *row, int rx) { // the screen line of the row rx is on
+    int lo = 0, hi = row -> summary.height - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row -> wraps[mid - 1] <= rx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+int linesBefore(int at) { // screen lines of rows [0, at)
+    rowTreeReady();
+    struct rowSummary range = { 0 };
+    rowTreeRange(editor.rowTreeRoot, 0, at, &range);
+    return range.height;
+}
+int rowAtLine(int line, int *seg) { // the row holding screen line line, numrows past the end
+    rowTreeReady();
+    int n = editor.rowTreeRoot, at = 0;
+    if (n == 0 || line >= editor.rowTree[n].sum.height) {
+        *seg = 0;
+        return editor.numrows;
+    }
+    while (1) {
+        struct rowNode *node = &editor.rowTree[n];
+        int above = editor.rowTree[node -> left].sum.height;
+        if (line < above) {
+            n = node -> left;
+            continue;
+        }
+        line -= above;
+        at += editor.rowTree[node -> left].size;
+        if (line < node -> row.height) break;
+        line -= node -> row.height;
+        at ++;
+        n = node -> right;
+    }
+    *seg = line;
+    return at;
+}
+void scrollWrapped() { // keeps the cursor's screen line in view, O(log n) in the number of rows
+    editor.colOffset = 0;
+    editorRow *row = editor.yCoord < editor.numrows ? &editor.row[editor.yCoord] : NULL;
+    int seg = row ? wrapSegment(row, editor.rx) : 0;
+    if (editor.rowOffset >= editor.numrows) editor.segOffset = 0;
+    else if (editor.segOffset >= editor.row[editor.rowOffset].summary.height) editor.segOffset = editor.row[editor.rowOffset].summary.height - 1;
+
+    if (editor.yCoord < editor.rowOffset || (editor.yCoord == editor.rowOffset && seg < editor.segOffset)) {
+        editor.rowOffset = editor.yCoord;
+        editor.segOffset = seg;
+    }
+    int top = linesBefore(editor.rowOffset) + editor.segOffset;
+    int line = linesBefore(editor.yCoord) + seg;
+    if (line >= top + editor.terminalRows) {
+        top = line - editor.terminalRows + 1;
+        editor.rowOffset = rowAtLine(top, &editor.segOffset);
+    }
+    editor.screenY = line - top;
+    editor.screenX = row ? editor.rx - wrapStart(row, seg) : 0;
+}
+void placeOnLine(int at, int seg, int col) { // cursor col columns into screen line seg of row at
+    editor.yCoord = at;
+    if (at >= editor.numrows) {
+        editor.xCoord = 0;
+        return;
+    }
+    editorRow *row = &editor.row[at];
+    int rx = wrapStart(row, seg) + col, end = wrapEnd(row, seg);
+    if (seg < row -> summary.height - 1 && rx >= end) rx = end - 1; // end itself is the next line's start
+    if (rx > end) rx = end;
+    editor.xCoord = rxToxCoord(row, rx);
+}
+void moveWrapped(int dir) { // one screen line up or down, keeping the column on screen
+    int at = editor.yCoord, seg = 0, col = 0;
+    if (at < editor.numrows) {
+        editorRow *row = &editor.row[at];
+        int rx = xCoordTorx(row, editor.xCoord);
+        seg = wrapSegment(row, rx);
+        col = rx - wrapStart(row, seg);
+    }
+    if (dir < 0 && seg > 0) seg --;
+    else if (dir < 0 && at > 0) seg = editor.row[-- at].summary.height - 1;
+    else if (dir > 0 && at < editor.numrows && seg < editor.row[at].summary.height - 1) seg ++;
+    else if (dir > 0 && at < editor.numrows) at ++, seg = 0;
+    placeOnLine(at, seg, col);
+}
+void pageWrapped(int lines) { // lines screen lines away from the top one, O(log n) however far
+    int seg, line = linesBefore(editor.rowOffset) + editor.segOffset + lines;
+    int at = rowAtLine(line < 0 ? 0 : line, &seg);
+    placeOnLine(at, seg, editor.screenX);
+}
+void wrapAllRows() { // at this view's width, rows that kept their text and width keep their wraps
+    editor.wrapCols = TEXT_COLS;
+    for (int j = 0; j < editor.numrows; j ++) wrapRow(&editor.row[j]);
+    editor.rowTreeStale = 1;
+}
+void editorToggleWrap() {
+    editor.softWrap = !editor.softWrap;
+    editor.wrapViews += editor.softWrap ? 1 : -1;
+    if (editor.softWrap) {
+        wrapAllRows();
+        editor.colOffset = 0;
+    }
+    editor.segOffset = 0;
+    setStatusMessage("\x1b[36m Soft wrap %s\x1b[m", editor.softWrap ? "on" : "off");
+}
+
+/*** identifier trie ***/
+int trieNode(int parent, char c) {
+    if (editor.trieFree == 0 && editor.trieNodes == editor.trieCap) {
+        editor.trieCap = editor.trieCap ? editor.trieCap * 2 : 1024;
+        editor.trie = realloc(editor.trie, sizeof(struct trieNode) * editor.trieCap);
+    }
+    int node;
+    if (editor.trieFree) { // reuse a node an identifier left behind
+        node = editor.trieFree;
+        editor.trieFree = editor.trie[node].next;
+    }
+    else node = editor.trieNodes ++;
+    struct trieNode fresh = { parent, 0, 0, 0, 0, c };
+    editor.trie[node] = fresh;
+    return node;
+}
+int trieChild(int node, char c) { // adds the child if it isn't there
+    int child;
+    for (child = editor.trie[node].child; child; child = editor.trie[child].next)
+        if (editor.trie[child].c == c) return child;
+    child = trieNode(node, c);
+    editor.trie[child].next = editor.trie[node].child;
+    editor.trie[node].child = child;
+    return child;
+}
+int trieAdd(char *word, int len) { // one more reference, returns the identifier's node
+    if (editor.trieNodes == 0) trieNode(0, '\0'); // the root
+    int node = 0;
+    for (int j = 0; j < len; j ++) node = trieChild(node, word[j]);
+    int count = ++ editor.trie[node].count;
+    // bounds only grow here; an ancestor already at count bounds everything above it too
+    for (int n = node; editor.trie[n].best < count; n = editor.trie[n].parent) {
+        editor.trie[n].best = count;
+        if (n == 0) break;
+    }
+    return node;
+}
+void trieRelease(int node) { // one reference less, nodes no identifier passes through any more go on the free list
+    editor.trie[node].count --;
+    while (node != 0 && editor.trie[node].count == 0 && editor.trie[node].child == 0) {
+        int parent = editor.trie[node].parent;
+        int *link = &editor.trie[parent].child;
+        while (*link != node) link = &editor.trie[*link].next;
+        *link = editor.trie[node].next;
+        editor.trie[node].next = editor.trieFree;
+        editor.trieFree = node;
+        node = parent;
+    }
+}
+int isIdentStart(int c) {
+    return isalpha(c) || c == '_';
+}
+void indexRowIdents(editorRow *row, char *hl, int startsInComment) { // only when the row's text or comment state changed
+    unsigned int key = row -> hash * 2 + startsInComment;
+    if (row -> identEpoch == editor.identEpoch && row -> identKey == key) return;
+
+    int *idents = NULL, numIdents = 0, cap = 0;
+    for (int i = 0; i < row -> rsize; ) {
+        if (!isIdentStart((unsigned char) row -> render[i]) || hl[i] == HL_COMMENT || hl[i] == HL_MLCOMMENT || hl[i] == HL_STRING) {
+            // skip the rest of a token such as 0x1f so its tail isn't taken for an identifier
+            if (isIdentChar((unsigned char) row -> render[i])) while (i < row -> rsize && isIdentChar((unsigned char) row -> render[i])) i ++;
+            else i ++;
+            continue;
+        }
+        int start = i;
+        while (i < row -> rsize && isIdentChar((unsigned char) row -> render[i])) i ++;
+        if (numIdents == cap) {
+            cap = cap ? cap * 2 : 8;
+            idents = realloc(idents, sizeof(int) * cap);
+        }
+        idents[numIdents ++] = trieAdd(&row -> render[start], i - start);
+    }
+    // added before removing, so identifiers that stay never drop to zero
+    for (int j = 0; j < row -> numIdents; j ++) trieRelease(row -> idents[j]);
+    free(row -> idents);
+    editor.indexBytes += (long) (numIdents - row -> numIdents) * sizeof(int);
+    row -> idents = idents;
+    row -> numIdents = numIdents;
+    row -> identKey = key;
+    row -> identEpoch = editor.identEpoch;
+}
+struct trieEntry { // a subtree by its bound, or an identifier by its count
+    int key, node, isWord, depth;
+};
+int trieEntryBefore(struct trieEntry *a, struct trieEntry *b) { // more references first, then whole words, then shorter ones
+    if (a -> key != b -> key) return a -> key > b -> key;
+    if (a -> isWord != b -> isWord) return a -> isWord;
+    return a -> depth < b -> depth;
+}
+void heapPush(struct trieEntry **heap, int *n, int *cap, struct trieEntry e) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *heap = realloc(*heap, sizeof(struct trieEntry) * *cap);
+    }
+    int j = (*n) ++;
+    while (j > 0 && trieEntryBefore(&e, &(*heap)[(j - 1) / 2])) {
+        (*heap)[j] = (*heap)[(j - 1) / 2];
+        j = (j - 1) / 2;
+    }
+    (*heap)[j] = e;
+}
+struct trieEntry heapPop(struct trieEntry *heap, int *n) {
+    struct trieEntry top = heap[0], last = heap[-- *n];
+    int j = 0;
+    while (2 * j + 1 < *n) {
+        int child = 2 * j + 1;
+        if (child + 1 < *n && trieEntryBefore(&heap[child + 1], &heap[child])) child ++;
+        if (!trieEntryBefore(&heap[child], &last)) break;
+        heap[j] = heap[child];
+        j = child;
+    }
+    if (*n) heap[j] = last;
+    return top;
+}
+char *trieWord(int node, int depth) {
+    char *word = malloc(depth + 1);
+    word[depth] = '\0';
+    for (int j = depth - 1; j >= 0; j --, node = editor.trie[node].parent) word[j] = editor.trie[node].c;
+    return word;
+}
+int completeIdent(char *prefix, int len, char **out) { // best first over the subtree of prefix, fills up to COMPLETION_MAX words
+    if (editor.trieNodes == 0) return 0;
+    int node = 0;
+    for (int j = 0; j < len && node != -1; j ++) {
+        int child;
+        for (child = editor.trie[node].child; child && editor.trie[child].c != prefix[j]; child = editor.trie[child].next);
+        node = child ? child : -1;
+    }
+    if (node == -1) return 0;
+
+    struct trieEntry *heap = NULL;
+    int n = 0, cap = 0, found = 0;
+    struct trieEntry first = { editor.trie[node].best, node, 0, len };
+    heapPush(&heap, &n, &cap, first);
+    while (n && found < COMPLETION_MAX) {
+        struct trieEntry e = heapPop(heap, &n);
+        if (e.key == 0) break;
+        if (e.isWord) {
+            if (e.depth > len) out[found ++] = trieWord(e.node, e.depth);
+            continue;
+        }
+        struct trieNode *t = &editor.trie[e.node];
+        int best = t -> count;
+        if (t -> count) {
+            struct trieEntry word = { t -> count, e.node, 1, e.depth };
+            heapPush(&heap, &n, &cap, word);
+        }
+        for (int child = t -> child; child; child = editor.trie[child].next) {
+            if (editor.trie[child].best == 0) continue;
+            struct trieEntry sub = { editor.trie[child].best, child, 0, e.depth + 1 };
+            heapPush(&heap, &n, &cap, sub);
+            if (editor.trie[child].best > best) best = editor.trie[child].best;
+        }
+        editor.trie[e.node].best = best; // tighter now that the children were looked at
+    }
+    free(heap);
+    return found;
+}
+void clearCompletions() {
+    for (int j = 0; j < editor.numCompletions; j ++) free(editor.completions[j]);
+    editor.numCompletions = 0;
+}
+void drawCompletions(struct abuf *ab) { // a popup under the word being completed, or above it near the bottom
+    int width = 0;
+    for (int j = 0; j < editor.numCompletions; j ++) {
+        int len = strlen(editor.completions[j]);
+        if (len > width) width = len;
+    }
+    width += 2;
+    if (width > editor.terminalCols) width = editor.terminalCols;
+    int top = editor.screenY + 1;
+    if (top + editor.numCompletions > editor.terminalRows) top = editor.screenY - editor.numCompletions;
+    if (top < 0) top = 0;
+    int left = editor.screenX - editor.completionPrefix + GUTTER_COLS;
+    if (left + width > editor.terminalCols) left = editor.terminalCols - width;
+    if (left < 0) left = 0;
+
+    for (int j = 0; j < editor.numCompletions; j ++) {
+        char buf[32];
+        abAppend(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%d;%dH", top + j + 1, left + 1));
+        abAppend(ab, j == editor.completionSelected ? "\x1b[7m" : "\x1b[44m", j == editor.completionSelected ? 4 : 5);
+        abAppend(ab, " ", 1);
+        int len = strlen(editor.completions[j]);
+        if (len > width - 2) len = width - 2;
+        abAppend(ab, editor.completions[j], len);
+        for (int pad = len + 1; pad < width; pad ++) abAppend(ab, " ", 1);
+        abAppend(ab, "\x1b[m", 3);
+    }
+}
+void editorComplete() {
+    if (editor.yCoord >= editor.numrows) return;
+    editorRow *row = &editor.row[editor.yCoord];
+    int start = editor.xCoord;
+    while (start > 0 && isIdentChar((unsigned char) row -> chars[start - 1])) start --;
+    int len = editor.xCoord - start;
+    if (len == 0 || !isIdentStart((unsigned char) row -> chars[start])) {
+        setStatusMessage("\x1b[36m Type the start of an identifier first\x1b[m");
+        return;
+    }
+    char *prefix = strndup(&row -> chars[start], len);
+    editor.numCompletions = completeIdent(prefix, len, editor.completions);
+    if (editor.numCompletions == 0) {
+        setStatusMessage("\x1b[36m No completions for %s\x1b[m", prefix);
+        free(prefix);
+        return;
+    }
+    free(prefix);
+    editor.completionSelected = 0;
+    editor.completionPrefix = len;
+
+    while (1) {
+        refreshScreen();
+        int c = readKey();
+        if (c == ARROW_DOWN || c == CTRL_KEY('n'))
+            editor.completionSelected = (editor.completionSelected + 1) % editor.numCompletions;
+        else if (c == ARROW_UP || c == CTRL_KEY('p'))
+            editor.completionSelected = (editor.completionSelected + editor.numCompletions - 1) % editor.numCompletions;
+        else if (c == '\r' || c == '\t') {
+            for (char *p = &editor.completions[editor.completionSelected][len]; *p; p ++) editorInsertChar(*p);
+            break;
+        }
+        else {
+            if (c != '\x1b') editor.pendingKey = c; // the popup closes and the key does what it always does
+            break;
+        }
+    }
+    clearCompletions();
+}
+
+/*** syntax highlighting ***/
+int isSeparator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+int colourCodes(int hl) {
+    switch (hl) {
+        case HL_MLCOMMENT:
+        case HL_COMMENT: return 36; //cyan
+        case HL_KEYWORD1: return 33; //Brown
+        case HL_KEYWORD2: return 32; // Green
+        case HL_NUMBER: return 31; //red
+        case HL_TEXT: return 33;
+        case HL_MATCH: return 32; //green // when we found the search results
+        case HL_STRING: return 34; //Blue
+        default: return 37;
+    }
+}
+void rangeMark(struct rowRange *r, int at) {
+    if (r -> from == -1 || at < r -> from) r -> from = at;
+    if (r -> to == -1 || at > r -> to) r -> to = at;
+}
+void rangeShift(struct rowRange *r, int at, int delta) { // rows were inserted (delta > 0) or deleted at at
+    if (r -> from == -1) return;
+    if (delta > 0) {
+        if (r -> from >= at) r -> from += delta;
+        if (r -> to >= at) r -> to += delta;
+        return;
+    }
+    int count = -delta;
+    if (r -> from >= at + count) r -> from -= count;
+    else if (r -> from > at) r -> from = at;
+    if (r -> to >= at + count) r -> to -= count;
+    else if (r -> to > at) r -> to = at;
+}
+void updateSyntax(editorRow *row) {
+    if (editor.hlSuspended) {
+        rangeMark(&editor.hlDirty, row -> index);
+        return;
+    }
+    highlightRow(row, row -> index > 0 && editor.row[row -> index - 1].hlOpenComment);
+}
+void highlightRow(editorRow *row, int inComment) { // inComment is the state the row starts in
+    if (row -> render == NULL) renderRow(row); // evicted, the highlight needs it back
+    row -> hlStartComment = inComment;
+    char *hl = hlScratch(row -> rsize + 1);
+    memset(hl, HL_NORMAL, row -> rsize);
+
+    if (editor.syntax == NULL) {
+        encodeSpans(row, hl);
+        indexRowIdents(row, hl, 0);
+        summarizeRow(row, hl);
+        return;
+    }
+
+    char **keywords = editor.syntax -> keywords;
+
+    char *scStart = editor.syntax -> singleLineCommentStart;
+    char *mcStart = editor.syntax -> multiLineCommentsStart;
+    char *mcEnd = editor.syntax -> multiLineCommentsEnd;
+
+    int scStartLen = scStart ? strlen(scStart) : 0;
+    int mcStartLen = mcStart ? strlen(mcStart) : 0;
+    int mcEndLen = mcEnd ? strlen(mcEnd) : 0;
+
+    int prevSeperator = 1;
+    int inString = 0;
+    int startsInComment = inComment;
+
+    int i = 0;
+    while (i < row->rsize) {
+        char c = row -> render[i];
+        char prevhl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+        
+        if (scStartLen && !inString && !inComment) {
+            if (!strncmp(&row->render[i], scStart, scStartLen)) {
+                memset(&hl[i], HL_COMMENT, row->rsize - i);
+                break;
+            }
+        }
+
+        if (mcStartLen && mcEndLen && !inString) {
+            if (inComment) {
+                hl[i] = HL_MLCOMMENT;
+                if (!strncmp(&row -> render[i], mcEnd, mcEndLen)) {
+                    memset(&hl[i], HL_MLCOMMENT, mcEndLen);
+                    i += mcEndLen;
+                    inComment = 0;
+                    prevSeperator = 1;
+                    continue;
+                } 
+                else {
+                    i ++;
+                    continue;
+                }
+            } 
+            else if (!strncmp(&row -> render[i], mcStart, mcStartLen)) {
+                memset(&hl[i], HL_MLCOMMENT, mcStartLen);
+                i += mcStartLen;
+                inComment = 1;
+                continue;
+            }
+        }
+
+        if (editor.syntax -> flags & HL_HIGHLIGHT_STRINGS) {
+            if (inString) {
+                hl[i] = HL_STRING;
+            if (c == '\\' && i + 1 < row -> rsize) {
+                hl[i + 1] = HL_STRING;
+                i += 2;
+                continue;
+            }
+            if (c == inString) inString = 0;
+                i ++;
+                prevSeperator = 1;
+                continue;
+            } 
+            else {
+                if (c == '"' || c == '\'') {
+                    inString = c;
+                    hl[i] = HL_STRING;
+                    i ++;
+                    continue;
+                }
+            }
+        }
+
+        if (editor.syntax -> flags & HL_HIGHLIGHT_NUMBERS) {
+            if ( (isdigit(c) && (prevSeperator || prevhl == HL_NUMBER)) || (c == '.' && prevhl == HL_NUMBER)) { //decimal numbers also
+                hl[i] = HL_NUMBER;
+                i ++;
+                prevSeperator = 0;
+                continue;
+            }
+        }
+        if (editor.syntax -> flags & HL_HIGHLIGHT_TEXT) {
+            hl[i] = HL_TEXT;
+        }
+        if (prevSeperator) {
+            int j;
+            for ( j = 0; keywords[j]; j++) {
+                int klen = strlen(keywords[j]);
+                int keword2 = keywords[j][klen - 1] == '|';
+                
+                if (keword2) klen --;
+                if (!strncmp(&row->render[i], keywords[j], klen) && isSeparator(row->render[i + klen])) {
+                    memset(&hl[i], keword2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                    i += klen;
+                    break;
+                }
+            }
+            if (keywords[j] != NULL) {
+                prevSeperator = 0;
+                continue;
+            }
+        }
+        prevSeperator = isSeparator(c);
+        i ++;
+    }
+    
+    int changed = (row -> hlOpenComment != inComment);
+    row -> hlOpenComment = inComment;
+    encodeSpans(row, hl);
+    indexRowSymbols(row, hl);
+    indexRowIdents(row, hl, startsInComment);
+    summarizeRow(row, hl);
+    if (changed && !editor.hlBatch && row -> index + 1 < editor.numrows)
+        updateSyntax(&editor.row[row -> index + 1]);
+}
+void selectSyntaxHighlight() {
+    editor.syntax = NULL;
+    editor.rowTreeStale = 1;
+    editor.identEpoch ++;
+    clearSymbols();
+    if (editor.fileName == NULL) return;
+    
+    char *name = strdup(editor.fileName);
+    char *ext = strrchr(name, '.');
+    if (codecForExtension(ext)) { // main.c.gz highlights like main.c
+        *ext = '\0';
+        ext = strrchr(name, '.');
+    }
+    
+    for (int entry = 0; entry < HLDB_ENTRIES; entry ++) {
+        struct editorSyntax *s = &HLDB[entry];
+        int i = 0;
+        while (s -> fileMatch[i]) {
+            int isExtension = (s -> fileMatch[i][0] == '.');
+            if ((isExtension && ext && !strcmp(ext, s -> fileMatch[i])) || (!isExtension && strstr(name, s -> fileMatch[i]))) {
+                editor.syntax = s;
+                
+                for ( int fileRow = 0; fileRow < editor.numrows; fileRow ++) {
+                    updateSyntax(&editor.row[fileRow]);
+                }
+
+                free(name);
+                return;
+            }
+            i++;
+        }
+    }
+    free(name);
+}
+
+/***manipulating row actions***/
+int renderSize(editorRow *row) { // bytes expandTabs needs, the terminator included
+    int tabs = 0;
+    for (int j = 0; j < row -> size; j ++) {
+        if (row -> chars[j] == '\t') tabs ++;
+    }
+    return row -> size + tabs * (TAB_STOP - 1) + 1;
+}
+int expandTabs(editorRow *row, char *out) { // chars with tabs turned into spaces, returns the length
+    int index = 0;
+    for (int j = 0; j < row -> size; j ++) {
+        if (row->chars[j] == '\t') {
+            out[index ++] = ' ';
+            while (index % TAB_STOP != 0) out[index ++] = ' ';
+        } 
+        else out[index ++] = row-> chars[j];
+    }
+    out[index] = '\0';
+    return index;
+}
+void renderRow(editorRow *row) { // render from chars, tabs expanded
+    editor.cacheBytes -= rowCacheBytes(row);
+    free(row -> render);
+    row -> render = malloc(renderSize(row));
+    row -> rsize = expandTabs(row, row -> render);
+    queueCacheUse(row);
+    editor.cacheBytes += rowCacheBytes(row);
+}
+void updateRender(editorRow *row) {
+    renderRow(row);
+
+    unsigned int hash = 2166136261u; // FNV-1a
+    for (int j = 0; j < row -> size; j ++) hash = (hash ^ (unsigned char) row -> chars[j]) * 16777619u;
+    row -> hash = hash;
+    if (row -> diffMark == ' ' || row -> diffMark == '-') row -> diffMark = '~';
+    rangeMark(&editor.diffDirty, row -> index);
+    row -> wrapWidth = 0;
+    wrapRow(row);
+    countRow(row);
+}
+void updateRow(editorRow *row) {
+    updateRender(row);
+    updateSyntax(row);
+}
+struct symbol *parkSymbols(int fromRow, int *parked) { // moves the symbols at or after fromRow aside, so new ones are appended instead of memmoved in
+    int split = symbolLowerBound(fromRow);
+    *parked = editor.numsymbols - split;
+    struct symbol *tail = malloc(sizeof(struct symbol) * (*parked + 1));
+    memcpy(tail, &editor.symbols[split], sizeof(struct symbol) * *parked);
+    editor.numsymbols = split;
+    return tail;
+}
+int unparkSymbols(struct symbol *tail, int next, int parked, int toRow) { // puts back the parked symbols before toRow, returns how many are back
+    for (; next < parked && tail[next].row < toRow; next ++) {
+        if (editor.numsymbols == editor.symbolCap) {
+            editor.symbolCap = editor.symbolCap ? editor.symbolCap * 2 : 64;
+            editor.symbols = realloc(editor.symbols, sizeof(struct symbol) * editor.symbolCap);
+        }
+        editor.symbols[editor.numsymbols ++] = tail[next];
+    }
+    return next;
+}
+void highlightRows(int from, int to) { // re-highlights rows [from, to) once each, in order
+    if (from >= to) return;
+    int parked;
+    struct symbol *tail = parkSymbols(to, &parked);
+
+    editor.hlBatch = 1;
+    for (int j = from; j < to; j ++) updateSyntax(&editor.row[j]);
+    editor.hlBatch = 0;
+
+    unparkSymbols(tail, 0, parked, editor.numrows);
+    free(tail);
+    // the row after the range may now start inside or outside a comment
+    if (to < editor.numrows) updateSyntax(&editor.row[to]);
+}
+void suspendHighlighting() {
+    editor.hlSuspended = 1;
+}
+void resumeHighlighting() { // highlights every row touched while suspended, once
+    editor.hlSuspended = 0;
+    if (editor.hlDirty.from == -1) return;
+    int to = editor.hlDirty.to + 1;
+    if (to > editor.numrows) to = editor.numrows;
+    int from = editor.hlDirty.from;
+    editor.hlDirty.from = editor.hlDirty.to = -1;
+    highlightRows(from, to);
+}
+void releaseChars(char *chars, int *shared) {
+    if (shared && -- *shared > 0) return;
+    free(shared);
+    free(chars);
+}
+void rowOwnChars(editorRow *row) { // copy on write before changing chars held by the clipboard
+    if (row -> shared == NULL) return;
+    if (*row -> shared > 1) {
+        char *copy = malloc(row -> size + 1);
+        memcpy(copy, row -> chars, row -> size);
+        copy[row -> size] = '\0';
+        (*row -> shared) --;
+        row -> chars = copy;
+    }
+    else free(row -> shared);
+    row -> shared = NULL;
+}
+void reserveRows(int count) { // grows geometrically so inserting line after line stays linear
+    if (editor.numrows + count <= editor.rowCap) return;
+    editor.rowCap = editor.rowCap * 2 > editor.numrows + count ? editor.rowCap * 2 : editor.numrows + count;
+    editor.row = realloc(editor.row, sizeof(editorRow) * editor.rowCap);
+}
+void openRowGap(int at, int count) { // count empty rows at at, the caller fills chars and highlights them
+    reserveRows(count);
+    memmove(&editor.row[at + count], &editor.row[at], sizeof(editorRow) * (editor.numrows - at));
+    for (int j = at + count; j < editor.numrows + count; j ++) editor.row[j].index += count;
+    shiftSymbols(at, count);
+    rangeShift(&editor.hlDirty, at, count);
+    shiftCacheQueue(at, count);
+    rangeShift(&editor.diffDirty, at, count);
+    rowTreeInsert(at, count);
+    memset(&editor.row[at], 0, sizeof(editorRow) * count);
+    for (int j = at; j < at + count; j ++) {
+        editor.row[j].index = j;
+        editor.row[j].diffMark = '+';
+        editor.row[j].identEpoch = -1;
+    }
+    editor.numrows += count;
+}
+void insertRow(int insertAt, char *s, size_t len) {
+    if ( insertAt < 0 || insertAt > editor.numrows) return; 
+    
+    reserveRows(1);
+    memmove(&editor.row[insertAt + 1], &editor.row[insertAt], sizeof(editorRow) * (editor.numrows - insertAt));
+    for (int j = insertAt + 1; j <= editor.numrows; j ++) editor.row[j].index ++;
+    shiftSymbols(insertAt, 1);
+    rangeShift(&editor.hlDirty, insertAt, 1);
+    shiftCacheQueue(insertAt, 1);
+    rangeShift(&editor.diffDirty, insertAt, 1);
+    rowTreeInsert(insertAt, 1);
+    
+    editor.row[insertAt].index = insertAt;
+    editor.row[insertAt].diffMark = '+';
+
+    editor.row[insertAt].size = len;
+    editor.row[insertAt].shared = NULL;
+    editor.row[insertAt].chars = malloc(len + 1);
+    memcpy(editor.row[insertAt].chars, s, len);
+    editor.row[insertAt].chars[len] = '\0';
+
+    editor.row[insertAt].rsize = 0;
+    editor.row[insertAt].render = NULL;
+    editor.row[insertAt].hl = NULL;
+    editor.row[insertAt].hlSpans = 0;
+    editor.row[insertAt].hlOpenComment = 0;
+    editor.row[insertAt].hlStartComment = 0;
+    memset(&editor.row[insertAt].summary, 0, sizeof(struct rowSummary));
+    editor.row[insertAt].wraps = NULL;
+    editor.row[insertAt].idents = NULL;
+    editor.row[insertAt].numIdents = 0;
+    editor.row[insertAt].identEpoch = -1;
+    updateRow(&editor.row[insertAt]);
+    editor.numrows ++;
+    editor.dirty ++;
+    editor.edits ++;
+}
 void freeRow(editorRow *row) {
+    editor.cacheBytes -= rowCacheBytes(row);
+    for (int j = 0; j < row -> numIdents; j ++) trieRelease(row -> idents[j]);
+    editor.indexBytes -= (long) row -> numIdents * sizeof(int);
+    if (row -> wraps) editor.indexBytes -= (long) (row -> summary.height - 1) * sizeof(int);
+    free(row -> idents);
+    free(row -> wraps);
     free(row -> render);
-    free(row -> chars);
+    releaseChars(row -> chars, row -> shared);
     free(row -> hl);
 }
+void deleteRows(int at, int count) {
+    for (int j = at; j < at + count; j ++) {
+        uncountRow(&editor.row[j]);
+        freeRow(&editor.row[j]);
+    }
+    removeSymbolRange(at, at + count);
+    shiftSymbols(at + count, -count);
+    rangeShift(&editor.hlDirty, at, -count);
+    shiftCacheQueue(at, -count);
+    rangeShift(&editor.diffDirty, at, -count);
+    rangeMark(&editor.diffDirty, at);
+    rowTreeRemove(at, count);
+    memmove(&editor.row[at], &editor.row[at + count], sizeof(editorRow) * (editor.numrows - at - count));
+    editor.numrows -= count;
+    for (int j = at; j < editor.numrows; j ++) editor.row[j].index -= count;
+    if (editor.hlSuspended && at < editor.numrows) rangeMark(&editor.hlDirty, at); // its comment state may have changed
+    int above = (at > 0) ? at - 1 : 0; // until the diff catches up
+    if (above < editor.numrows && editor.row[above].diffMark == ' ') editor.row[above].diffMark = '-';
+}
 void delRow(int at) {
     if (at < 0 || at >= editor.numrows) return;
-    freeRow(&editor.row[at]);
-    memmove(&editor.row[at], &editor.row[at + 1], sizeof(editorRow) * (editor.numrows - at - 1));
-    for (int j = at + 1; j <= editor.numrows; j ++) editor.row[j].index ++;
-    editor.numrows --;
+    deleteRows(at, 1);
     editor.dirty ++;
+    editor.edits ++;
 }
 void rowInsertChar(editorRow *row, int insertAt, int c) {
     if (insertAt < 0 || insertAt > row -> size) insertAt = row -> size;
+    rowOwnChars(row);
     row -> chars = realloc(row -> chars, row -> size + 2);
     memmove(&row -> chars[insertAt + 1], &row -> chars[insertAt], row -> size - insertAt + 1);
     row -> size++;
     row -> chars[insertAt] = c;
     updateRow(row);
     editor.dirty ++;
+    editor.edits ++;
 }
 void rowAppendString(editorRow *row, char *s, size_t len) {
+    rowOwnChars(row);
     row -> chars = realloc(row -> chars, row -> size + len + 1);
     memcpy(&row -> chars[row -> size], s, len);
     row -> size += len;
     row -> chars[row -> size] = '\0';
     updateRow(row);
     editor.dirty ++;
+    editor.edits ++;
 }
 void rowDelChar(editorRow *row, int at) {
     if (at < 0 || at >= row->size) return;
+    rowOwnChars(row);
     memmove(& row -> chars[at], &row -> chars[at + 1], row -> size - at);
     row -> size --;
     updateRow(row);
     editor.dirty ++;
+    editor.edits ++;
+}
+
+/*** memory budget ***/
+int rowCacheBytes(editorRow *row) {
+    return (row -> render ? row -> rsize + 1 : 0) + row -> hlSpans * sizeof(struct hlSpan);
+}
+void rowEnsureRender(editorRow *row) { // brings render and hl back after an eviction, from chars and the comment state above
+    if (row -> lastUsed != editor.cacheTick) queueCacheUse(row);
+    if (row -> render) return;
+    if (editor.hlSuspended) { // left for resumeHighlighting, like the rows the batch edits
+        renderRow(row);
+        rangeMark(&editor.hlDirty, row -> index);
+        return;
+    }
+    highlightRow(row, row -> hlStartComment); // the state it was last highlighted from, so the result matches what was dropped
+}
+char *rowText(editorRow *row) { // render to read once, an evicted row is expanded into scratch instead of brought back
+    if (row -> render) return row -> render;
+    int size = renderSize(row);
+    if (size > editor.renderScratchSize) {
+        editor.renderScratchSize = size * 2;
+        editor.renderScratch = realloc(editor.renderScratch, editor.renderScratchSize);
+    }
+    expandTabs(row, editor.renderScratch);
+    return editor.renderScratch;
+}
+void evictRow(editorRow *row) {
+    editor.cacheBytes -= rowCacheBytes(row);
+    free(row -> render);
+    free(row -> hl);
+    row -> render = NULL;
+    row -> hl = NULL;
+    row -> hlSpans = 0;
+}
+long memoryUse() { // text, caches, per row tables and the big arrays, what the budget is held against
+    return editor.totals.bytes + editor.cacheBytes + editor.indexBytes
+        + (long) editor.rowCap * sizeof(editorRow) + (long) editor.rowTreeCap * sizeof(struct rowNode)
+        + (long) editor.trieCap * sizeof(struct trieNode) + (long) editor.symbolCap * sizeof(struct symbol)
+        + (long) editor.savedCap * sizeof(unsigned int) + (editor.diffMatch ? (long) editor.diffRows * sizeof(int) : 0)
+        + (long) editor.cacheCap * sizeof(struct cacheUse);
+}
+int cacheUseLive(struct cacheUse *u) { // whether the entry is still the row's latest and its caches are still there
+    return u -> row >= 0 && u -> row < editor.numrows && editor.row[u -> row].render && editor.row[u -> row].lastUsed == u -> tick;
+}
+void queueCacheUse(editorRow *row) { // the row's caches were needed now, so they go after every row needed before
+    row -> lastUsed = editor.cacheTick;
+    if (memBudget == 0) return;
+    if (editor.cacheLen == editor.cacheCap) { // drop what's done with and what's stale before growing
+        int kept = 0;
+        for (int j = editor.cacheHead; j < editor.cacheLen; j ++)
+            if (cacheUseLive(&editor.cacheQueue[j])) editor.cacheQueue[kept ++] = editor.cacheQueue[j];
+        editor.cacheHead = 0;
+        editor.cacheLen = kept;
+        if (kept >= editor.cacheCap / 2) {
+            editor.cacheCap = editor.cacheCap ? editor.cacheCap * 2 : 1024;
+            editor.cacheQueue = realloc(editor.cacheQueue, sizeof(struct cacheUse) * editor.cacheCap);
+        }
+    }
+    struct cacheUse use = { row -> index, editor.cacheTick };
+    editor.cacheQueue[editor.cacheLen ++] = use;
+}
+void shiftCacheQueue(int at, int delta) { // rows were inserted (delta > 0) or deleted (delta < 0) at at
+    if (at >= editor.numrows) return; // appended, nothing queued moves
+    for (int j = editor.cacheHead; j < editor.cacheLen; j ++) {
+        struct cacheUse *u = &editor.cacheQueue[j];
+        if (u -> row < at) continue;
+        if (delta < 0 && u -> row < at - delta) u -> row = -1;
+        else u -> row += delta;
+    }
+}
+int nearView(int at) { // rows a page either side of the screen are kept for scrolling
+    return at >= editor.rowOffset - editor.terminalRows && at < editor.rowOffset + 2 * editor.terminalRows;
+}
+void trimCaches() { // evicts the least recently needed rows away from the screen until memory use is under the budget
+    long use = memoryUse();
+    if (memBudget == 0 || use <= memBudget || use <= editor.trimAgainAt) return;
+    long excess = use - memBudget + memBudget / 8; // some slack so the next trim isn't a row away
+
+    // oldest first off the queue, rows near the screen go to the back, so each entry is looked at once
+    long freed = 0;
+    for (int left = editor.cacheLen - editor.cacheHead; left > 0 && freed < excess && editor.cacheHead < editor.cacheLen; left --) {
+        struct cacheUse u = editor.cacheQueue[editor.cacheHead ++];
+        if (!cacheUseLive(&u)) continue;
+        editorRow *row = &editor.row[u.row];
+        if (nearView(u.row)) queueCacheUse(row);
+        else {
+            freed += rowCacheBytes(row);
+            evictRow(row);
+        }
+    }
+    use = memoryUse();
+    editor.trimAgainAt = use > memBudget ? use + memBudget / 8 : 0;
+}
+void formatBytes(long bytes, char *out, int size) {
+    if (bytes < 10 * 1024) snprintf(out, size, "%ldB", bytes);
+    else if (bytes < 10L * 1024 * 1024) snprintf(out, size, "%ldK", bytes >> 10);
+    else if (bytes < 10L * 1024 * 1024 * 1024) snprintf(out, size, "%ldM", bytes >> 20);
+    else snprintf(out, size, "%ldG", bytes >> 30);
+}
+long parseBytes(char *s) { // 512M, 2G, 100000..., -1 when it isn't a size
+    char *end;
+    long n = strtol(s, &end, 10);
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') shift = 10;
+    else if (*end == 'M' || *end == 'm') shift = 20;
+    else if (*end == 'G' || *end == 'g') shift = 30;
+    if (shift) end ++;
+    if (end == s || *end || n <= 0) return -1;
+    return n << shift;
 }
 
 /*** editor operations ***/
+void clampCursor() { // back onto the text after rows went away under it
+    if (editor.yCoord > editor.numrows) editor.yCoord = editor.numrows;
+    if (editor.yCoord < editor.numrows && editor.xCoord > editor.row[editor.yCoord].size) editor.xCoord = editor.row[editor.yCoord].size;
+    if (editor.yCoord == editor.numrows) editor.xCoord = 0;
+}
 void editorInsertChar(int c) {
     if (editor.yCoord == editor.numrows)
         insertRow(editor.numrows, "", 0);
@@ -665,6 +2326,7 @@ void editorInsertNewline() {
         editorRow * row = &editor.row[editor.yCoord];
         insertRow(editor.yCoord + 1, &row -> chars[editor.xCoord], row -> size - editor.xCoord);
         row = &editor.row[editor.yCoord];
+        rowOwnChars(row);
         row -> size = editor.xCoord;
         row -> chars[row -> size] = '\0';
         updateRow(row);
@@ -689,27 +2351,356 @@ void editorDelChar() {
     }
 }
 
+/*** selection and clipboard ***/
+int getSelection(int *sy, int *sx, int *ey, int *ex) { // ordered bounds in chars, 0 when nothing is selected
+    if (!editor.selecting) return 0;
+    int my = editor.markY, mx = editor.markX;
+    if (my >= editor.numrows) {
+        my = editor.numrows;
+        mx = 0;
+    }
+    else if (mx > editor.row[my].size) mx = editor.row[my].size;
+    int cy = editor.yCoord, cx = editor.xCoord;
+    if (my < cy || (my == cy && mx <= cx)) {
+        *sy = my; *sx = mx; *ey = cy; *ex = cx;
+    }
+    else {
+        *sy = cy; *sx = cx; *ey = my; *ex = mx;
+    }
+    if (*ey >= editor.numrows && editor.numrows > 0) { // the line past the end has no text
+        *ey = editor.numrows - 1;
+        *ex = editor.row[*ey].size;
+    }
+    return !(*sy == *ey && *sx == *ex) && editor.numrows > 0;
+}
+int selectionOverlay(int fileRow, struct overlay *o) { // the selected render columns of fileRow
+    int sy, sx, ey, ex;
+    if (!getSelection(&sy, &sx, &ey, &ex) || fileRow < sy || fileRow > ey) return 0;
+    editorRow *row = &editor.row[fileRow];
+    int start = (fileRow == sy) ? xCoordTorx(row, sx) : 0;
+    int end = (fileRow == ey) ? xCoordTorx(row, ex) : row -> rsize + 1; // + 1 shows the selected line break
+    o -> row = fileRow;
+    o -> start = start;
+    o -> len = end - start;
+    o -> hl = HL_SELECTION;
+    return 1;
+}
+void clearClipboard() {
+    for (int j = 0; j < editor.clipLines; j ++) releaseChars(editor.clipboard[j].chars, editor.clipboard[j].shared);
+    free(editor.clipboard);
+    editor.clipboard = NULL;
+    editor.clipLines = 0;
+}
+void copySelection(int sy, int sx, int ey, int ex) { // shares the rows' chars instead of copying them
+    clearClipboard();
+    editor.clipLines = ey - sy + 1;
+    editor.clipboard = malloc(sizeof(struct clipSpan) * editor.clipLines);
+    for (int j = sy; j <= ey; j ++) {
+        editorRow *row = &editor.row[j];
+        if (row -> shared == NULL) {
+            row -> shared = malloc(sizeof(int));
+            *row -> shared = 1;
+        }
+        (*row -> shared) ++;
+        struct clipSpan *span = &editor.clipboard[j - sy];
+        span -> chars = row -> chars;
+        span -> shared = row -> shared;
+        span -> off = (j == sy) ? sx : 0;
+        span -> len = ((j == ey) ? ex : row -> size) - span -> off;
+    }
+}
+void deleteSelection(int sy, int sx, int ey, int ex) {
+    editorRow *first = &editor.row[sy];
+    editorRow *last = &editor.row[ey];
+    int tail = last -> size - ex;
+    char *chars = malloc(sx + tail + 1);
+    memcpy(chars, first -> chars, sx);
+    memcpy(&chars[sx], &last -> chars[ex], tail);
+    chars[sx + tail] = '\0';
+    releaseChars(first -> chars, first -> shared);
+    first -> chars = chars;
+    first -> shared = NULL;
+    first -> size = sx + tail;
+
+    if (ey > sy) deleteRows(sy + 1, ey - sy);
+    updateRender(&editor.row[sy]);
+    highlightRows(sy, sy + 1);
+    editor.yCoord = sy;
+    editor.xCoord = sx;
+    editor.dirty ++;
+    editor.edits ++;
+}
+void pasteClipboard() { // opens all the rows at once and highlights them in one pass
+    if (editor.clipLines == 0) return;
+    if (editor.yCoord == editor.numrows) insertRow(editor.numrows, "", 0);
+    int y = editor.yCoord, x = editor.xCoord;
+    int n = editor.clipLines;
+    struct clipSpan *first = &editor.clipboard[0], *last = &editor.clipboard[n - 1];
+
+    editorRow *row = &editor.row[y];
+    int tail = row -> size - x;
+    char *tailChars = malloc(tail + 1);
+    memcpy(tailChars, &row -> chars[x], tail);
+
+    // the first line joins the text before the cursor
+    rowOwnChars(row);
+    int firstLen = (n == 1) ? first -> len + tail : first -> len;
+    row -> chars = realloc(row -> chars, x + firstLen + 1);
+    memcpy(&row -> chars[x], &first -> chars[first -> off], first -> len);
+    if (n == 1) memcpy(&row -> chars[x + first -> len], tailChars, tail);
+    row -> size = x + firstLen;
+    row -> chars[row -> size] = '\0';
+    updateRender(row);
+
+    if (n > 1) {
+        openRowGap(y + 1, n - 1);
+        for (int j = 1; j < n - 1; j ++) { // whole lines keep pointing at the clipboard's buffers
+            struct clipSpan *span = &editor.clipboard[j];
+            editorRow *r = &editor.row[y + j];
+            if (span -> off == 0 && span -> shared) {
+                r -> chars = span -> chars;
+                r -> shared = span -> shared;
+                (*span -> shared) ++;
+            }
+            else {
+                r -> chars = malloc(span -> len + 1);
+                memcpy(r -> chars, &span -> chars[span -> off], span -> len);
+                r -> chars[span -> len] = '\0';
+            }
+            r -> size = span -> len;
+            updateRender(r);
+        }
+        // the last line takes the text after the cursor
+        editorRow *r = &editor.row[y + n - 1];
+        r -> chars = malloc(last -> len + tail + 1);
+        memcpy(r -> chars, &last -> chars[last -> off], last -> len);
+        memcpy(&r -> chars[last -> len], tailChars, tail);
+        r -> size = last -> len + tail;
+        r -> chars[r -> size] = '\0';
+        updateRender(r);
+    }
+    free(tailChars);
+    highlightRows(y, y + n);
+
+    editor.yCoord = y + n - 1;
+    editor.xCoord = (n == 1) ? x + first -> len : last -> len;
+    editor.dirty ++;
+    editor.edits ++;
+}
+void editorCopy(int cut) {
+    int sy, sx, ey, ex;
+    if (!getSelection(&sy, &sx, &ey, &ex)) {
+        setStatusMessage("\x1b[31m Nothing selected (Ctrl+B marks the start of a selection)\x1b[m");
+        return;
+    }
+    copySelection(sy, sx, ey, ex);
+    if (cut) deleteSelection(sy, sx, ey, ex);
+    editor.selecting = 0;
+    setStatusMessage("\x1b[32m %s %d line%s\x1b[m", cut ? "Cut" : "Copied", editor.clipLines, editor.clipLines == 1 ? "" : "s");
+}
+void editorPaste() {
+    if (editor.clipLines == 0) {
+        setStatusMessage("\x1b[31m Clipboard is empty\x1b[m");
+        return;
+    }
+    pasteClipboard();
+    setStatusMessage("\x1b[32m Pasted %d line%s\x1b[m", editor.clipLines, editor.clipLines == 1 ? "" : "s");
+}
+
 /*** file i/o ***/
-void editorOpen(char *fileName) {
+#define LOADER_MAX_PENDING (4 << 20) // the reader thread stalls instead of buffering the whole file
+
+pid_t spawnFilter(char *const argv[], int inFd, int outFd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(inFd, STDIN_FILENO);
+        dup2(outFd, STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull != -1) dup2(devnull, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+void *loaderThread(void *arg) {
+    struct fileLoader *ld = arg;
+    char chunk[1 << 16];
+    while (1) {
+        ssize_t n = read(ld -> fd, chunk, sizeof(chunk));
+        if (n == -1 && errno == EINTR) continue;
+        pthread_mutex_lock(&ld -> lock);
+        if (n <= 0) {
+            if (n == -1) ld -> error = errno;
+            ld -> done = 1;
+            pthread_cond_signal(&ld -> ready);
+            pthread_mutex_unlock(&ld -> lock);
+            return NULL;
+        }
+        while (ld -> pendingLen >= LOADER_MAX_PENDING) pthread_cond_wait(&ld -> space, &ld -> lock);
+        if (ld -> pendingLen + n > ld -> pendingCap) {
+            ld -> pendingCap = (ld -> pendingLen + n) * 2;
+            ld -> pending = realloc(ld -> pending, ld -> pendingCap);
+        }
+        memcpy(&ld -> pending[ld -> pendingLen], chunk, n);
+        ld -> pendingLen += n;
+        pthread_cond_signal(&ld -> ready);
+        pthread_mutex_unlock(&ld -> lock);
+    }
+}
+int abandonLoader(struct fileLoader *ld, int error) { // undoes a startLoader that failed part way
+    close(ld -> fd);
+    if (ld -> pid > 0) waitpid(ld -> pid, NULL, 0); // the decompressor stops once its pipe has no reader
+    free(ld);
+    errno = error;
+    return -1;
+}
+int startLoader(int fileFd, struct codec *codec) { // codec is what fileFd is stored in, NULL for plain text; -1 with errno set when the reader can't be started, fileFd is closed then
+    struct fileLoader *ld = calloc(1, sizeof(struct fileLoader));
+    ld -> fd = fileFd;
+    if (codec) {
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) == -1) return abandonLoader(ld, errno);
+        ld -> pid = spawnFilter(codec -> decompress, fileFd, p[1]);
+        int error = errno;
+        close(p[1]);
+        close(fileFd);
+        ld -> fd = p[0];
+        if (ld -> pid == -1) return abandonLoader(ld, error);
+    }
+    pthread_mutex_init(&ld -> lock, NULL);
+    pthread_cond_init(&ld -> ready, NULL);
+    pthread_cond_init(&ld -> space, NULL);
+    int error = pthread_create(&ld -> thread, NULL, loaderThread, ld);
+    if (error) {
+        pthread_mutex_destroy(&ld -> lock);
+        pthread_cond_destroy(&ld -> ready);
+        pthread_cond_destroy(&ld -> space);
+        return abandonLoader(ld, error);
+    }
+    editor.loader = ld;
+    return 0;
+}
+void finishLoader() {
+    struct fileLoader *ld = editor.loader;
+    pthread_join(ld -> thread, NULL);
+    close(ld -> fd);
+    int failed = ld -> error;
+    if (ld -> pid > 0) {
+        int status;
+        waitpid(ld -> pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+    }
+    editor.readError = failed ? (ld -> error ? ld -> error : EIO) : 0;
+    if (failed) setStatusMessage("\x1b[31m Couldn't read all of the file (%s)\x1b[m", ld -> pid ? editor.codec -> name : strerror(ld -> error));
+    pthread_mutex_destroy(&ld -> lock);
+    pthread_cond_destroy(&ld -> ready);
+    pthread_cond_destroy(&ld -> space);
+    free(ld -> pending);
+    free(ld -> work);
+    free(ld);
+    editor.loader = NULL;
+}
+void adoptLine(char *line, size_t linelen) {
+    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+        linelen--;
+    insertRow(editor.numrows, line, linelen);
+    editorRow *row = &editor.row[editor.numrows - 1];
+    row -> diffMark = ' ';
+    if (editor.numSaved == editor.savedCap) {
+        editor.savedCap = editor.savedCap ? editor.savedCap * 2 : 1024;
+        editor.savedHashes = realloc(editor.savedHashes, sizeof(unsigned int) * editor.savedCap);
+    }
+    editor.savedHashes[editor.numSaved ++] = row -> hash;
+}
+int loadPendingRows(int budgetMs) { // turns streamed bytes into rows for about budgetMs, returns 1 once the file is in
+    struct fileLoader *ld = editor.loader;
+    if (ld == NULL) return 1;
+    int dirty = editor.dirty;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int adopted = 0;
+    while (1) {
+        char *nl;
+        while ((nl = memchr(&ld -> work[ld -> workPos], '\n', ld -> workLen - ld -> workPos))) {
+            adoptLine(&ld -> work[ld -> workPos], nl - &ld -> work[ld -> workPos]);
+            ld -> workPos = nl - ld -> work + 1;
+            if (++ adopted % 256 == 0) {
+                trimCaches();
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= budgetMs) {
+                    editor.dirty = dirty;
+                    return 0;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&ld -> lock);
+        if (ld -> pendingLen == 0 && !ld -> done) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += budgetMs * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&ld -> ready, &ld -> lock, &deadline);
+            if (ld -> pendingLen == 0 && !ld -> done) {
+                pthread_mutex_unlock(&ld -> lock);
+                editor.dirty = dirty;
+                return 0;
+            }
+        }
+        int finished = ld -> done && ld -> pendingLen == 0;
+        if (!finished) { // keep the partial last line and append what the thread has read since
+            size_t leftover = ld -> workLen - ld -> workPos;
+            if (leftover + ld -> pendingLen > ld -> workCap) {
+                ld -> workCap = (leftover + ld -> pendingLen) * 2;
+                char *work = malloc(ld -> workCap);
+                memcpy(work, &ld -> work[ld -> workPos], leftover);
+                free(ld -> work);
+                ld -> work = work;
+            }
+            else memmove(ld -> work, &ld -> work[ld -> workPos], leftover);
+            memcpy(&ld -> work[leftover], ld -> pending, ld -> pendingLen);
+            ld -> workLen = leftover + ld -> pendingLen;
+            ld -> workPos = 0;
+            ld -> pendingLen = 0;
+            pthread_cond_signal(&ld -> space);
+        }
+        pthread_mutex_unlock(&ld -> lock);
+
+        if (finished) {
+            if (ld -> workPos < ld -> workLen) adoptLine(&ld -> work[ld -> workPos], ld -> workLen - ld -> workPos);
+            finishLoader();
+            editor.dirty = dirty;
+            return 1;
+        }
+    }
+}
+void finishLoading() {
+    while (!loadPendingRows(1000));
+}
+int editorOpen(char *fileName) { // -1 with errno set when the file can't be opened
     free(editor.fileName);
     editor.fileName = strdup(fileName);
     
     selectSyntaxHighlight();
+    editor.codec = codecForExtension(strrchr(fileName, '.')); // what a new, empty or unrecognised file is saved as
+
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    editor.numSaved = 0;
+    editor.diffFull = 1;
 
-    FILE *fp = fopen(fileName, "r");
-    if (!fp) handleError("fopen");
+    unsigned char magic[4];
+    ssize_t magicLen = pread(fd, magic, sizeof(magic), 0);
+    struct codec *stored = codecForMagic(magic, magicLen > 0 ? magicLen : 0);
+    if (stored) editor.codec = stored;
     
-    char *line = NULL;
-    size_t lineCapacity = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &lineCapacity, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
-        insertRow(editor.numrows, line, linelen);
-    }
-    free(line);
-    fclose(fp);
+    if (startLoader(fd, stored) == -1) return -1;
+    // the rest of the file streams in from readKey while the user is idle
+    while (editor.numrows < editor.terminalRows && !loadPendingRows(50));
     editor.dirty = 0;
+    return 0;
 }
 char *rowsToString(int *bufferLen) {
     int totalLen = 0;
@@ -725,51 +2716,302 @@ char *rowsToString(int *bufferLen) {
         *p = '\n';
         p ++;
     }
-    return buf;
+    return buf;
+}
+long saveCompressed(int fd) { // streams rows through the compressor, returns the uncompressed size or -1
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) == -1) return -1;
+    pid_t pid = spawnFilter(editor.codec -> compress, p[0], fd);
+    close(p[0]);
+    if (pid == -1) {
+        close(p[1]);
+        return -1;
+    }
+    void (*oldHandler)(int) = signal(SIGPIPE, SIG_IGN);
+    FILE *out = fdopen(p[1], "w");
+    int ok = (out != NULL);
+    long total = 0;
+    for (int j = 0; ok && j < editor.numrows; j ++) {
+        if (fwrite(editor.row[j].chars, 1, editor.row[j].size, out) != (size_t) editor.row[j].size || fputc('\n', out) == EOF) ok = 0;
+        total += editor.row[j].size + 1;
+    }
+    if (out) {
+        if (fclose(out) != 0) ok = 0;
+    }
+    else close(p[1]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    signal(SIGPIPE, oldHandler);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errno = EIO;
+        ok = 0;
+    }
+    return ok ? total : -1;
+}
+long writeFile() { // returns the bytes written, or -1 with errno set
+    if (editor.loader) finishLoading();
+    long written = -1;
+    if (editor.codec) { // compressed next to the file and renamed over it, so a failing tool leaves the old file alone
+        char *tmp = malloc(strlen(editor.fileName) + 8);
+        sprintf(tmp, "%s.XXXXXX", editor.fileName);
+        int fd = mkostemp(tmp, O_CLOEXEC);
+        if (fd == -1) {
+            free(tmp);
+            return -1;
+        }
+        struct stat st;
+        fchmod(fd, stat(editor.fileName, &st) == 0 ? st.st_mode & 07777 : 0644);
+        written = saveCompressed(fd);
+        if (written != -1 && fsync(fd) == -1) written = -1;
+        int saved = errno;
+        close(fd);
+        if (written != -1 && rename(tmp, editor.fileName) == -1) {
+            written = -1;
+            saved = errno;
+        }
+        if (written == -1) unlink(tmp);
+        free(tmp);
+        errno = saved;
+    }
+    else {
+        int len;
+        char *buf = rowsToString(&len);
+        int fd = open(editor.fileName, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            if (ftruncate(fd, len) != -1 && write(fd, buf, len) == len) written = len;
+            int saved = errno;
+            close(fd);
+            errno = saved;
+        }
+        free(buf);
+    }
+    if (written != -1) {
+        editor.dirty = 0;
+        snapshotSaved();
+    }
+    return written;
+}
+void editorSave() {
+    if (editor.fileName == NULL) {
+        editor.fileName = prompt("\x1b[34mSave as: %s (ESC to cancel)", NULL);
+        if (editor.fileName == NULL) {
+            setStatusMessage("\x1b[36m Save aborted\x1b[m");
+            return;
+        }
+        editor.codec = codecForExtension(strrchr(editor.fileName, '.'));
+        selectSyntaxHighlight();
+    }
+
+    long written = writeFile();
+    if (editor.codec) {
+        if (written != -1) setStatusMessage("\x1b[32m %ld bytes written to disk (%s)\x1b[m", written, editor.codec -> name);
+        else setStatusMessage("\x1b[31m Can't save! %s error: %s\x1b[m", editor.codec -> name, strerror(errno));
+    }
+    else if (written != -1) setStatusMessage("\x1b[32m %ld bytes written to disk\x1b[m", written);
+    else setStatusMessage("\x1b[31m Can't save! I/O error: %s\x1b[m", strerror(errno));
+}
+
+/*** diff ***/
+#define DIFF_MAX_COST 4096 // past this many edits in one slice its lines are just marked changed
+
+struct myers {
+    unsigned int *a, *b;
+    int *match;
+    int *vf, *vb; // furthest reaching paths, forward and backward
+};
+int middleSnake(struct myers *m, int a0, int a1, int b0, int b1, int *sx, int *sy, int *ex, int *ey) { // 0 when it costs too much
+    unsigned int *A = &m -> a[a0], *B = &m -> b[b0];
+    int n = a1 - a0, M = b1 - b0, delta = n - M, odd = delta & 1;
+    int max = (n + M + 1) / 2;
+    int *vf = &m -> vf[max + 1], *vb = &m -> vb[max + 1];
+    vf[1] = vb[1] = 0;
+    for (int d = 0; d <= max && d <= DIFF_MAX_COST; d ++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && vf[k - 1] < vf[k + 1])) ? vf[k + 1] : vf[k - 1] + 1;
+            int y = x - k, x0 = x, y0 = y;
+            while (x < n && y < M && A[x] == B[y]) {
+                x ++;
+                y ++;
+            }
+            vf[k] = x;
+            int c = delta - k;
+            if (odd && c >= -(d - 1) && c <= d - 1 && vf[k] + vb[c] >= n) {
+                *sx = a0 + x0; *sy = b0 + y0; *ex = a0 + x; *ey = b0 + y;
+                return 1;
+            }
+        }
+        for (int c = -d; c <= d; c += 2) { // the same from the ends, x and y count back from n and M
+            int x = (c == -d || (c != d && vb[c - 1] < vb[c + 1])) ? vb[c + 1] : vb[c - 1] + 1;
+            int y = x - c, x0 = x, y0 = y;
+            while (x < n && y < M && A[n - x - 1] == B[M - y - 1]) {
+                x ++;
+                y ++;
+            }
+            vb[c] = x;
+            int k = delta - c;
+            if (!odd && k >= -d && k <= d && vb[c] + vf[k] >= n) {
+                *sx = a0 + n - x; *sy = b0 + M - y; *ex = a0 + n - x0; *ey = b0 + M - y0;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+void diffSlice(struct myers *m, int a0, int a1, int b0, int b1) { // Myers in linear space, matches a[a0, a1) against b[b0, b1)
+    while (a0 < a1 && b0 < b1 && m -> a[a0] == m -> b[b0]) m -> match[a0 ++] = b0 ++;
+    while (a0 < a1 && b0 < b1 && m -> a[a1 - 1] == m -> b[b1 - 1]) m -> match[-- a1] = -- b1;
+    if (a0 == a1 || b0 == b1) return;
+
+    int sx, sy, ex, ey;
+    if (!middleSnake(m, a0, a1, b0, b1, &sx, &sy, &ex, &ey)) return;
+    diffSlice(m, a0, sx, b0, sy);
+    for (int x = sx, y = sy; x < ex; x ++, y ++) m -> match[x] = y;
+    diffSlice(m, ex, a1, ey, b1);
+}
+void diffMarks(struct diffJob *job) { // turns matched rows into gutter markers
+    int n = job -> numrows;
+    job -> marks = malloc(n + 1);
+    memset(job -> marks, ' ', n);
+    int prevSaved = -1;
+    for (int j = 0; j <= n; ) {
+        int next = j;
+        while (next < n && job -> match[next] == -1) next ++;
+        int saved = (next < n) ? job -> match[next] : job -> numsaved;
+        int added = next - j, removed = saved - prevSaved - 1;
+        for (int t = 0; t < added; t ++) job -> marks[j + t] = (t < removed) ? '~' : '+';
+        if (added == 0 && removed > 0 && n > 0) job -> marks[j > 0 ? j - 1 : 0] = '-';
+        prevSaved = saved;
+        j = next + 1;
+    }
+}
+void *diffThread(void *arg) {
+    struct diffJob *job = arg;
+    int n = job -> numrows;
+    job -> match = malloc(sizeof(int) * (n + 1));
+    for (int j = 0; j < n; j ++) job -> match[j] = -1;
+
+    // only rows between the nearest unchanged matches around the edits are diffed again
+    int a = -1, sa = -1, b = n, sb = job -> numsaved;
+    if (job -> base) {
+        int delta = n - job -> baseRows;
+        int first = job -> from;
+        if (first > n) first = n;
+        if (first > job -> baseRows) first = job -> baseRows;
+        for (a = first - 1; a >= 0 && job -> base[a] == -1; a --);
+        for (int j = 0; j <= a; j ++) job -> match[j] = job -> base[j];
+        if (a >= 0) sa = job -> base[a];
+        for (b = job -> to + 1; b < n && job -> base[b - delta] == -1; b ++);
+        for (int j = b; j < n; j ++) job -> match[j] = job -> base[j - delta];
+        if (b < n) sb = job -> base[b - delta];
+    }
+    int size = (b - a) + (sb - sa) + 4;
+    struct myers m = { job -> rows, job -> saved, job -> match, malloc(sizeof(int) * size), malloc(sizeof(int) * size) };
+    diffSlice(&m, a + 1, b, sa + 1, sb);
+    free(m.vf);
+    free(m.vb);
+    diffMarks(job);
+    return NULL;
+}
+void snapshotSaved() { // the rows are what is on disk now
+    unsigned int *hashes = malloc(sizeof(unsigned int) * (editor.numrows + 1));
+    for (int j = 0; j < editor.numrows; j ++) {
+        hashes[j] = editor.row[j].hash;
+        editor.row[j].diffMark = ' ';
+    }
+    if (editor.diffJob && editor.diffJob -> saved == editor.savedHashes) editor.diffJob -> ownsSaved = 1;
+    else free(editor.savedHashes);
+    editor.savedHashes = hashes;
+    editor.numSaved = editor.savedCap = editor.numrows;
+    editor.diffFull = 1;
+}
+void startDiff() {
+    struct diffJob *job = calloc(1, sizeof(struct diffJob));
+    job -> numrows = editor.numrows;
+    job -> rows = malloc(sizeof(unsigned int) * (editor.numrows + 1));
+    for (int j = 0; j < editor.numrows; j ++) job -> rows[j] = editor.row[j].hash;
+    job -> saved = editor.savedHashes;
+    job -> numsaved = editor.numSaved;
+    if (editor.diffMatch && !editor.diffFull) {
+        job -> base = editor.diffMatch;
+        job -> baseRows = editor.diffRows;
+        job -> from = editor.diffDirty.from;
+        job -> to = editor.diffDirty.to;
+    }
+    if (pthread_create(&job -> thread, NULL, diffThread, job) != 0) {
+        free(job -> rows);
+        free(job);
+        return;
+    }
+    editor.diffDirty.from = editor.diffDirty.to = -1;
+    editor.diffFull = 0;
+    editor.diffJob = job;
 }
-void editorSave() {
-    if (editor.fileName == NULL) {
-        editor.fileName = prompt("\x1b[34mSave as: %s (ESC to cancel)", NULL);
-        if (editor.fileName == NULL) {
-            setStatusMessage("\x1b[36m Save aborted\x1b[m");
+void finishDiff(struct diffJob *job) { // takes the result of a joined job
+    // rows changed since the job started keep their own markers until the next diff
+    int from = editor.diffDirty.from, to = editor.diffDirty.to, delta = editor.numrows - job -> numrows;
+    for (int j = 0; j < editor.numrows; j ++) {
+        if (from != -1 && j >= from && j <= to) continue;
+        int k = (from != -1 && j > to) ? j - delta : j;
+        if (k >= 0 && k < job -> numrows) editor.row[j].diffMark = job -> marks[k];
+    }
+    free(editor.diffMatch);
+    editor.diffMatch = job -> match;
+    editor.diffRows = job -> numrows;
+    if (job -> ownsSaved) free(job -> saved);
+    free(job -> rows);
+    free(job -> marks);
+    free(job);
+    editor.diffJob = NULL;
+}
+int diffPending() {
+    return editor.diffJob || (editor.loader == NULL && (editor.diffFull || editor.diffDirty.from != -1));
+}
+int diffTick() { // takes a finished diff and starts the next one, returns 1 when the gutter changed
+    int changed = 0;
+    if (editor.diffJob) {
+        if (pthread_tryjoin_np(editor.diffJob -> thread, NULL) != 0) return 0;
+        finishDiff(editor.diffJob);
+        changed = 1;
+    }
+    if (diffPending()) startDiff();
+    return changed;
+}
+void stopDiff() {
+    if (editor.diffJob == NULL) return;
+    pthread_join(editor.diffJob -> thread, NULL);
+    finishDiff(editor.diffJob);
+}
+void editorNextHunk() { // the first changed row after the current run of them, wrapping around
+    int y = editor.yCoord;
+    for (int step = 0; step < 2; step ++) {
+        while (y < editor.numrows && editor.row[y].diffMark != ' ') y ++;
+        while (y < editor.numrows && editor.row[y].diffMark == ' ') y ++;
+        if (y < editor.numrows) {
+            editor.yCoord = y;
+            editor.xCoord = 0;
             return;
         }
-        selectSyntaxHighlight();
-    }
-
-    int len;
-    char *buf = rowsToString(&len);
-    
-    int fd = open(editor.fileName, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                editor.dirty = 0;
-                setStatusMessage("\x1b[32m %d bytes written to disk\x1b[m", len);
-                return;
-            }
+        y = 0;
+        if (editor.numrows && editor.row[0].diffMark != ' ') {
+            editor.yCoord = editor.xCoord = 0;
+            return;
         }
-        close(fd);
     }
-    free(buf);
-    setStatusMessage("\x1b[31m Can't save! I/O error: %s\x1b[m", strerror(errno));
+    setStatusMessage("\x1b[36m No changes since the last save\x1b[m");
 }
 
 /**Find**/
 
 void editorFindCallback(char *sequence, int key) { //for incremental search
-    static int last_match = -1;
-    static int direction = 1;
+    static __thread int last_match = -1;
+    static __thread int direction = 1;
+    static __thread unsigned long matchedAt; // edits when last_match was found
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
-    if (saved_hl) {
-        memcpy(editor.row[saved_hl_line].hl, saved_hl, editor.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
+    editor.overlays[OVERLAY_SEARCH].row = -1;
+    if (last_match != -1 && matchedAt != editor.edits) // another shared client edited while the prompt waited, go on from the cursor
+        last_match = editor.yCoord < editor.numrows ? editor.yCoord : -1;
+    matchedAt = editor.edits;
     if ( key == '\r' || key == '\x1b') {
         last_match = -1;
         direction = 1;
@@ -796,17 +3038,16 @@ void editorFindCallback(char *sequence, int key) { //for incremental search
         else if (current == editor.numrows) current = 0;
 
         editorRow *row = &editor.row[current];
-        char *match = strstr(row -> render, sequence);
+        char *text = rowText(row);
+        char *match = strstr(text, sequence);
         if (match) {
             last_match = current;
             editor.yCoord = current;
-            editor.xCoord = rxToxCoord(row, match - row -> render);
+            editor.xCoord = rxToxCoord(row, match - text);
             editor.rowOffset = editor.numrows;
 
-            saved_hl_line = current;
-            saved_hl = malloc(row -> rsize);
-            memcpy(saved_hl, row -> hl, row -> rsize);
-            memset(&row -> hl[match - row -> render], HL_MATCH, strlen(sequence));
+            struct overlay found = { current, match - text, strlen(sequence), HL_MATCH };
+            editor.overlays[OVERLAY_SEARCH] = found;
             break;
         }
     }
@@ -824,11 +3065,361 @@ void editorFind() {
         editor.yCoord = saved_cy;
         editor.rowOffset = saved_rowOff;
         editor.colOffset = saved_colOff;
+        clampCursor();
+    }
+}
+
+/**Replace**/
+
+struct replacer { // what replaceAll looks for and puts in its place
+    int isRegex;
+    char *text; // literal
+    int textLen;
+    regex_t regex;
+    char *with; // $0 - $9 insert groups of a regex match, $$ is a $
+    int withLen;
+};
+struct replaceOut { // the row being rebuilt, reused across rows
+    char *b;
+    int len, cap;
+};
+void outAppend(struct replaceOut *out, const char *s, int len) {
+    if (out -> len + len > out -> cap) {
+        out -> cap = (out -> len + len) * 2;
+        out -> b = realloc(out -> b, out -> cap);
+    }
+    memcpy(&out -> b[out -> len], s, len);
+    out -> len += len;
+}
+const char *initReplacer(struct replacer *r, char *find, char *with, int isRegex) { // NULL, or why find doesn't compile
+    memset(r, 0, sizeof(*r));
+    r -> isRegex = isRegex;
+    r -> text = find;
+    r -> textLen = strlen(find);
+    r -> with = with;
+    r -> withLen = strlen(with);
+    static __thread char error[80];
+    int code = isRegex ? regcomp(&r -> regex, find, REG_EXTENDED) : 0;
+    if (code == 0) return NULL;
+    regerror(code, &r -> regex, error, sizeof(error));
+    r -> isRegex = 0;
+    return error;
+}
+void freeReplacer(struct replacer *r) {
+    if (r -> isRegex) regfree(&r -> regex);
+}
+void expandReplacement(struct replacer *r, struct replaceOut *out, char *base, regmatch_t *groups) {
+    for (int j = 0; j < r -> withLen; j ++) {
+        char c = r -> with[j];
+        if (c == '$' && j + 1 < r -> withLen && isdigit(r -> with[j + 1])) {
+            regmatch_t *g = &groups[r -> with[++ j] - '0'];
+            if (g -> rm_so != -1) outAppend(out, &base[g -> rm_so], g -> rm_eo - g -> rm_so);
+        }
+        else if (c == '$' && j + 1 < r -> withLen && r -> with[j + 1] == '$') outAppend(out, &r -> with[++ j], 1);
+        else outAppend(out, &c, 1);
+    }
+}
+int replaceRow(struct replacer *r, editorRow *row, struct replaceOut *out) { // rebuilds row into out in one scan, returns the count
+    char *p = row -> chars, *end = &row -> chars[row -> size];
+    int count = 0;
+    out -> len = 0;
+    if (!r -> isRegex) {
+        char *match;
+        while ((match = memmem(p, end - p, r -> text, r -> textLen))) {
+            outAppend(out, p, match - p);
+            outAppend(out, r -> with, r -> withLen);
+            p = match + r -> textLen;
+            count ++;
+        }
+    }
+    else {
+        regmatch_t groups[10];
+        char *prevEnd = NULL;
+        int flags = 0;
+        while (regexec(&r -> regex, p, 10, groups, flags) == 0) {
+            char *start = p + groups[0].rm_so, *stop = p + groups[0].rm_eo;
+            flags = REG_NOTBOL;
+            if (start == stop && start == prevEnd) { // no empty match right after another match
+                if (start >= end) break;
+                outAppend(out, p, start - p + 1);
+                p = start + 1;
+                continue;
+            }
+            outAppend(out, p, start - p);
+            expandReplacement(r, out, p, groups);
+            count ++;
+            prevEnd = p = stop;
+            if (start == stop) { // step over a character so an empty match can't repeat
+                if (p >= end) break;
+                outAppend(out, p ++, 1);
+            }
+        }
+    }
+    if (count) outAppend(out, p, end - p);
+    return count;
+}
+void highlightUndoRows() { // each row in the undo list once, going past one only while the comment state it ends in flips
+    if (editor.undoRows == 0) return;
+    int parked, back = 0, done = 0;
+    struct symbol *tail = parkSymbols(editor.undo[editor.undoRows - 1].row, &parked);
+    editor.hlBatch = 1;
+    for (int j = editor.undoRows - 1; j >= 0; j --) { // the list is newest first, so bottom up
+        int y = editor.undo[j].row;
+        if (y < done) continue; // a comment opened or closed above it got here already
+        while (y < editor.numrows) {
+            back = unparkSymbols(tail, back, parked, y + 1);
+            int ended = editor.row[y].hlOpenComment;
+            updateSyntax(&editor.row[y ++]);
+            if (editor.row[y - 1].hlOpenComment == ended) break;
+        }
+        done = y;
+    }
+    editor.hlBatch = 0;
+    unparkSymbols(tail, back, parked, editor.numrows);
+    free(tail);
+}
+void dropUndo() {
+    for (int j = 0; j < editor.undoRows; j ++) releaseChars(editor.undo[j].chars, editor.undo[j].shared);
+    free(editor.undo);
+    editor.undo = NULL;
+    editor.undoRows = 0;
+}
+int replaceAll(struct replacer *r, int *changedRows) { // every match in the file, returns how many
+    dropUndo();
+    struct replaceOut out = { NULL, 0, 0 };
+    int total = 0, undoCap = 0;
+    *changedRows = 0;
+    // bottom up so the undo list is newest first, highlighting waits until every row has its new text
+    for (int y = editor.numrows - 1; y >= 0; y --) {
+        editorRow *row = &editor.row[y];
+        int count = replaceRow(r, row, &out);
+        if (count == 0) continue;
+
+        if (editor.undoRows == undoCap) {
+            undoCap = undoCap ? undoCap * 2 : 64;
+            editor.undo = realloc(editor.undo, sizeof(struct undoRow) * undoCap);
+        }
+        struct undoRow old = { y, row -> size, row -> chars, row -> shared };
+        editor.undo[editor.undoRows ++] = old;
+
+        row -> chars = malloc(out.len + 1);
+        memcpy(row -> chars, out.b, out.len);
+        row -> chars[out.len] = '\0';
+        row -> size = out.len;
+        row -> shared = NULL;
+        updateRender(row);
+        total += count;
+    }
+    free(out.b);
+    highlightUndoRows();
+    *changedRows = editor.undoRows;
+    if (total) {
+        editor.dirty ++;
+        editor.undoEdits = ++ editor.edits;
+    }
+    if (editor.yCoord < editor.numrows && editor.xCoord > editor.row[editor.yCoord].size)
+        editor.xCoord = editor.row[editor.yCoord].size;
+    return total;
+}
+void editorReplace() {
+    char *find = prompt("\x1b[34mReplace: %s (/regex/ | ESC to cancel)\x1b[m", NULL);
+    if (find == NULL) return;
+    char *with = promptInput("\x1b[34mReplace with: %s (ESC to cancel)\x1b[m", NULL, 1);
+    if (with == NULL) {
+        free(find);
+        return;
+    }
+    int len = strlen(find), isRegex = (len > 2 && find[0] == '/' && find[len - 1] == '/');
+    if (isRegex) {
+        find[len - 1] = '\0';
+        memmove(find, find + 1, len - 1);
+    }
+
+    struct replacer r;
+    const char *error = initReplacer(&r, find, with, isRegex);
+    if (error) setStatusMessage("\x1b[31m Bad regex: %s\x1b[m", error);
+    else {
+        if (editor.loader) finishLoading();
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int rows, count = replaceAll(&r, &rows);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (count) setStatusMessage("\x1b[32m Replaced %d occurrence%s on %d line%s in %.2fs (Ctrl+Z to undo)\x1b[m", count, count == 1 ? "" : "s",
+                rows, rows == 1 ? "" : "s", seconds);
+        else setStatusMessage("\x1b[36m No matches for %s\x1b[m", find);
+        freeReplacer(&r);
+    }
+    free(find);
+    free(with);
+}
+void editorUndo() { // puts back the rows of the last replace-all
+    if (editor.undoRows == 0 || editor.edits != editor.undoEdits) {
+        dropUndo();
+        setStatusMessage("\x1b[36m Nothing to undo, only a replace with no edits after it can be undone\x1b[m");
+        return;
+    }
+    int rows = editor.undoRows;
+    for (int j = 0; j < rows; j ++) {
+        struct undoRow *old = &editor.undo[j];
+        editorRow *row = &editor.row[old -> row];
+        releaseChars(row -> chars, row -> shared);
+        row -> chars = old -> chars;
+        row -> shared = old -> shared;
+        row -> size = old -> size;
+        updateRender(row);
+    }
+    highlightUndoRows();
+    free(editor.undo);
+    editor.undo = NULL;
+    editor.undoRows = 0;
+    editor.dirty ++;
+    editor.edits ++;
+    if (editor.yCoord < editor.numrows && editor.xCoord > editor.row[editor.yCoord].size)
+        editor.xCoord = editor.row[editor.yCoord].size;
+    setStatusMessage("\x1b[32m Undid the replace on %d line%s\x1b[m", rows, rows == 1 ? "" : "s");
+}
+
+/**Go to symbol**/
+
+int fuzzyScore(char *name, char *query) { // -1 unless query is a subsequence of name
+    int score = 0, prevMatch = -2, q = 0;
+    for (int i = 0; name[i] && query[q]; i ++) {
+        if (tolower(name[i]) != tolower(query[q])) continue;
+        score += 1;
+        if (prevMatch == i - 1) score += 5; // consecutive characters
+        if (i == 0 || name[i - 1] == '_' || (islower(name[i - 1]) && isupper(name[i]))) score += 8; // word start
+        prevMatch = i;
+        q ++;
+    }
+    if (query[q]) return -1;
+    if (!strcasecmp(name, query)) score += 100;
+    return score * 16 - (int)strlen(name);
+}
+struct symbolMatch {
+    int symbol;
+    int score;
+};
+int compareSymbolMatch(const void *a, const void *b) {
+    const struct symbolMatch *x = a, *y = b;
+    if (x -> score != y -> score) return y -> score - x -> score;
+    return x -> symbol - y -> symbol;
+}
+void editorSymbolCallback(char *query, int key) {
+    static __thread struct symbolMatch *matches = NULL;
+    static __thread int numMatches = 0;
+    static __thread int selected = 0;
+    static __thread unsigned long matchedAt; // edits when matches were taken
+
+    int typed = !(key == '\r' || key == '\x1b' || key == ARROW_DOWN || key == ARROW_RIGHT || key == ARROW_UP || key == ARROW_LEFT);
+    if (typed || matchedAt != editor.edits) { // a new query, or another shared client's edit moved the symbols
+        matches = realloc(matches, sizeof(struct symbolMatch) * (editor.numsymbols + 1));
+        numMatches = 0;
+        for (int j = 0; j < editor.numsymbols; j ++) {
+            int score = fuzzyScore(editor.symbols[j].name, query);
+            if (score < 0) continue;
+            matches[numMatches].symbol = j;
+            matches[numMatches ++].score = score;
+        }
+        qsort(matches, numMatches, sizeof(struct symbolMatch), compareSymbolMatch);
+        if (typed || selected >= numMatches) selected = 0;
+        matchedAt = editor.edits;
+    }
+
+    if (key == '\r' || key == '\x1b') {
+        if (key == '\r' && numMatches) {
+            struct symbol *sym = &editor.symbols[matches[selected].symbol];
+            setStatusMessage("\x1b[32m %s %s (line %d)\x1b[m", symbolKindNames[sym -> kind], sym -> name, sym -> row + 1);
+        }
+        free(matches);
+        matches = NULL;
+        numMatches = selected = 0;
+        return;
+    }
+    else if (key == ARROW_DOWN || key == ARROW_RIGHT) {
+        if (numMatches) selected = (selected + 1) % numMatches;
+    }
+    else if (key == ARROW_UP || key == ARROW_LEFT) {
+        if (numMatches) selected = (selected + numMatches - 1) % numMatches;
+    }
+    if (numMatches == 0) return;
+
+    struct symbol *sym = &editor.symbols[matches[selected].symbol];
+    editor.yCoord = sym -> row;
+    editor.xCoord = rxToxCoord(&editor.row[sym -> row], sym -> rx);
+    editor.rowOffset = editor.numrows;
+}
+void editorGotoSymbol() {
+    int saved_cx = editor.xCoord;
+    int saved_cy = editor.yCoord;
+    int saved_colOff = editor.colOffset;
+    int saved_rowOff = editor.rowOffset;
+
+    if (editor.numsymbols == 0) {
+        setStatusMessage("\x1b[31m No definitions indexed in this file\x1b[m");
+        return;
+    }
+    char *query = prompt("\x1b[32mGo to definition: %s (Arrows to cycle | Enter to jump | ESC to cancel)\x1b[m", editorSymbolCallback);
+    if (query) free(query);
+    else {
+        editor.xCoord = saved_cx;
+        editor.yCoord = saved_cy;
+        editor.rowOffset = saved_rowOff;
+        editor.colOffset = saved_colOff;
+        clampCursor();
+    }
+}
+
+/*** macros ***/
+void editorToggleRecording() {
+    if (editor.recording) {
+        editor.recording = 0;
+        editor.macroLen --; // drop the Ctrl+K that stopped it
+        setStatusMessage("\x1b[32m Recorded %d key%s (Ctrl+E to replay)\x1b[m", editor.macroLen, editor.macroLen == 1 ? "" : "s");
+    }
+    else {
+        editor.recording = 1;
+        editor.macroLen = 0;
+        setStatusMessage("\x1b[34m Recording keys, Ctrl+K to stop\x1b[m");
     }
 }
+void replayMacro(int times) { // nothing is drawn or highlighted until the last iteration is done
+    editor.replaying = 1;
+    suspendHighlighting();
+    for (int t = 0; t < times; t ++) {
+        editor.replayPos = 0;
+        while (editor.replayPos < editor.macroLen) processKey();
+    }
+    editor.replaying = 0;
+    resumeHighlighting();
+}
+void editorReplayMacro() {
+    if (editor.replaying) return; // a replay never starts another one
+    if (editor.recording) {
+        editor.macroLen --;
+        setStatusMessage("\x1b[31m Stop recording (Ctrl+K) before replaying\x1b[m");
+        return;
+    }
+    if (editor.macroLen == 0) {
+        setStatusMessage("\x1b[31m No macro recorded (Ctrl+K starts recording)\x1b[m");
+        return;
+    }
+    char *count = prompt("\x1b[34mReplay how many times: %s (ESC to cancel)\x1b[m", NULL);
+    if (count == NULL) return;
+    int times = atoi(count);
+    free(count);
+    if (times <= 0) return;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    replayMacro(times);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    setStatusMessage("\x1b[32m Replayed %d time%s in %.2fs\x1b[m", times, times == 1 ? "" : "s", seconds);
+}
 
 /*** input ***/
-char *prompt(char *message, void (*callback)(char *, int)) {
+char *promptInput(char *message, void (*callback)(char *, int), int allowEmpty) {
     size_t bufferSize = 128;
     char *buffer = malloc(bufferSize);
 
@@ -850,7 +3441,7 @@ char *prompt(char *message, void (*callback)(char *, int)) {
             return NULL;
         } 
         else if (c == '\r') {
-            if ( bufferLen != 0) {
+            if ( bufferLen != 0 || allowEmpty) {
                 setStatusMessage("");
                 if (callback) callback(buffer, c);
                 return buffer;
@@ -867,6 +3458,9 @@ char *prompt(char *message, void (*callback)(char *, int)) {
         if (callback) callback(buffer, c);
     }
 }
+char *prompt(char *message, void (*callback)(char *, int)) {
+    return promptInput(message, callback, 0);
+}
 
 void moveCursor(int key) {
     editorRow *row = (editor.yCoord >= editor.numrows) ? NULL : &editor.row[editor.yCoord];
@@ -889,11 +3483,13 @@ void moveCursor(int key) {
             }
             break;
         case ARROW_UP:
-            if (editor.yCoord != 0) 
+            if (editor.softWrap) moveWrapped(-1);
+            else if (editor.yCoord != 0) 
             editor.yCoord --;
             break;
         case ARROW_DOWN:
-            if (editor.yCoord < editor.numrows) 
+            if (editor.softWrap) moveWrapped(1);
+            else if (editor.yCoord < editor.numrows) 
             editor.yCoord ++;
             break;
     }
@@ -904,19 +3500,29 @@ void moveCursor(int key) {
     }
 }
 void processKey() {
-    static int quit_times = 1;
+    static __thread int quit_times = 1;
     int c = readKey();
+    int keepSelection = 0;
 
     switch (c) {
         case '\r': 
             editorInsertNewline();
             break;
         case CTRL_KEY('q'):
-        if (editor.dirty && quit_times) {
+        if (editor.recording || editor.replaying) { // a macro never quits, least of all with highlighting suspended halfway through
+            if (editor.recording) editor.macroLen --;
+            setStatusMessage("\x1b[31m Stop recording (Ctrl+K) before quitting\x1b[m");
+            return;
+        }
+        if (editor.dirty && quit_times && !otherClients()) { // the changes only go when the last client does
             setStatusMessage("\x1b[31m WARNING!! This file contains unsaved changes. Press Ctrl+Q again to exit\x1b[m");
             quit_times --;
             return;
         }
+            if (editor.wakeFd != -1) { // detach, the server keeps the buffer for the others
+                editor.detached = 1;
+                break;
+            }
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -926,14 +3532,53 @@ void processKey() {
             break;
         case HOME_KEY:
             editor.xCoord = 0;
+            keepSelection = 1;
             break;
         case END_KEY:
             if (editor.yCoord < editor.numrows)
                 editor.xCoord = editor.row[editor.yCoord].size;
+            keepSelection = 1;
             break;
         case CTRL_KEY('f'):
             editorFind();
             break;
+        case CTRL_KEY('g'):
+            editorGotoSymbol();
+            break;
+        case CTRL_KEY('b'):
+            editor.selecting = !editor.selecting;
+            editor.markX = editor.xCoord;
+            editor.markY = editor.yCoord;
+            keepSelection = editor.selecting;
+            break;
+        case CTRL_KEY('c'):
+        case CTRL_KEY('x'):
+            editorCopy(c == CTRL_KEY('x'));
+            break;
+        case CTRL_KEY('v'):
+            editorPaste();
+            break;
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('d'):
+            editorNextHunk();
+            break;
+        case CTRL_KEY('n'):
+            editorComplete();
+            break;
+        case CTRL_KEY('w'):
+            editorToggleWrap();
+            break;
+        case CTRL_KEY('k'):
+            editorToggleRecording();
+            break;
+        case CTRL_KEY('e'):
+            editorReplayMacro();
+            break;
         case BACK_SPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -943,20 +3588,25 @@ void processKey() {
         
         case PAGE_UP:
         case PAGE_DOWN:
-            if (c == PAGE_UP)
-                editor.yCoord = editor.rowOffset;
-            else if (c == PAGE_DOWN)
-                editor.yCoord = editor.rowOffset + editor.terminalRows - 1;
-            if (editor.yCoord > editor.numrows) editor.yCoord = editor.numrows;
-            int times = editor.terminalRows;
-            while (times --)
-            moveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);        
+            if (editor.softWrap) // a screen up from the top line, or down from the bottom one
+                pageWrapped(c == PAGE_UP ? -editor.terminalRows : 2 * editor.terminalRows - 1);
+            else {
+                if (c == PAGE_UP)
+                    editor.yCoord = editor.rowOffset - editor.terminalRows;
+                else if (c == PAGE_DOWN)
+                    editor.yCoord = editor.rowOffset + 2 * editor.terminalRows - 1;
+                if (editor.yCoord < 0) editor.yCoord = 0;
+                if (editor.yCoord > editor.numrows) editor.yCoord = editor.numrows;
+                moveCursor(0); // clamps x to the new row
+            }
+            keepSelection = 1;
             break;
         case ARROW_UP:
         case ARROW_DOWN:
         case ARROW_LEFT:
         case ARROW_RIGHT:
             moveCursor(c);
+            keepSelection = 1;
             break;
         case CTRL_KEY('l'):
         case '\x1b':
@@ -965,29 +3615,684 @@ void processKey() {
             editorInsertChar(c);
             break;
     }
+    if (!keepSelection) editor.selecting = 0;
     quit_times = 1;
 }
 
+/*** batch mode ***/
+enum batchOp { BATCH_FIND, BATCH_REPLACE, BATCH_GOTO, BATCH_INSERT, BATCH_DELETE, BATCH_SAVE };
+struct batchCommand { // one line of a --batch script
+    int op;
+    char *text, *with; // unescaped arguments
+    int n, m;
+    int line;
+};
+struct batchJob { // shared by the worker threads
+    struct batchCommand *commands;
+    int numCommands;
+    char **files;
+    int numFiles;
+    int next; // next file to claim, under lock
+    int failures;
+    pthread_mutex_t lock;
+    char **reports; // one line per file, printed in order once all are done
+};
+
+char *unescapeArg(char *s) { // \n, \t and \\ as in C strings
+    char *out = malloc(strlen(s) + 1);
+    int n = 0;
+    for (; *s; s ++) {
+        if (*s == '\\' && s[1]) {
+            s ++;
+            out[n ++] = (*s == 'n') ? '\n' : (*s == 't') ? '\t' : *s;
+        }
+        else out[n ++] = *s;
+    }
+    out[n] = '\0';
+    return out;
+}
+const char *parseBatchCommand(char *name, char *arg, struct batchCommand *c) { // NULL, or what is wrong with the line
+    if (!strcmp(name, "find") || !strcmp(name, "insert")) {
+        c -> op = (name[0] == 'f') ? BATCH_FIND : BATCH_INSERT;
+        c -> text = unescapeArg(arg);
+        if (c -> text[0] == '\0') return "expected some text";
+        if (c -> op == BATCH_FIND && strchr(c -> text, '\n')) return "find can't span lines";
+    }
+    else if (!strcmp(name, "replace")) { // replace /old/new/ with any delimiter
+        char delimiter = arg[0];
+        char *mid = delimiter ? strchr(arg + 1, delimiter) : NULL;
+        char *end = mid ? strchr(mid + 1, delimiter) : NULL;
+        if (end == NULL) return "expected replace /old/new/";
+        *mid = *end = '\0';
+        c -> op = BATCH_REPLACE;
+        c -> text = unescapeArg(arg + 1);
+        c -> with = unescapeArg(mid + 1);
+        if (c -> text[0] == '\0') return "nothing to replace";
+        if (strchr(c -> text, '\n') || strchr(c -> with, '\n')) return "replace can't span lines";
+    }
+    else if (!strcmp(name, "goto")) {
+        c -> op = BATCH_GOTO;
+        c -> m = 1;
+        if (sscanf(arg, "%d %d", &c -> n, &c -> m) < 1 || c -> n < 1 || c -> m < 1) return "expected goto LINE [COLUMN]";
+    }
+    else if (!strcmp(name, "delete")) {
+        c -> op = BATCH_DELETE;
+        if (sscanf(arg, "%d", &c -> n) != 1 || c -> n < 1) return "expected delete COUNT";
+    }
+    else if (!strcmp(name, "save")) c -> op = BATCH_SAVE;
+    else return "unknown command";
+    return NULL;
+}
+int parseBatchScript(char *path, struct batchCommand **commands) { // the number of commands, or -1 after saying why
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int n = 0, lineNo = 0;
+    *commands = NULL;
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        lineNo ++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[-- len] = '\0';
+        char *name = line;
+        while (*name == ' ' || *name == '\t') name ++;
+        if (*name == '\0' || *name == '#') continue;
+        char *arg = name + strcspn(name, " \t");
+        if (*arg) *arg ++ = '\0'; // one separator, the rest belongs to the argument
+
+        *commands = realloc(*commands, sizeof(struct batchCommand) * (n + 1));
+        struct batchCommand *c = &(*commands)[n ++];
+        memset(c, 0, sizeof(*c));
+        c -> line = lineNo;
+        const char *error = parseBatchCommand(name, arg, c);
+        if (error) {
+            fprintf(stderr, "%s:%d: %s\n", path, lineNo, error);
+            n = -1;
+            break;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return n;
+}
+int batchFind(char *text) { // moves the cursor to the next match at or after it, 0 when there is none
+    for (int y = editor.yCoord; y < editor.numrows; y ++) {
+        editorRow *row = &editor.row[y];
+        int from = (y == editor.yCoord) ? editor.xCoord : 0;
+        char *match = strstr(&row -> chars[from], text);
+        if (match) {
+            editor.yCoord = y;
+            editor.xCoord = match - row -> chars;
+            return 1;
+        }
+    }
+    return 0;
+}
+void batchDelete(int count) { // count characters from the cursor on, a line break counts as one
+    int y = editor.yCoord, x = editor.xCoord;
+    if (y >= editor.numrows) return;
+    while (count --) {
+        if (x < editor.row[y].size) x ++;
+        else if (y + 1 < editor.numrows) {
+            y ++;
+            x = 0;
+        }
+        else break;
+    }
+    if (y != editor.yCoord || x != editor.xCoord) deleteSelection(editor.yCoord, editor.xCoord, y, x);
+}
+char *runBatchFile(struct batchJob *job, char *fileName, int *failed) { // applies the script to the calling thread's editor, returns the report
+    char report[512];
+    int replaced = 0, saved = 0;
+    *failed = 0;
+    editor.terminalRows = 0; // nothing to fill before the whole file is read
+    suspendHighlighting(); // nothing is drawn, so rows are never highlighted
+
+    int error = 0;
+    if (editorOpen(fileName) == -1) error = errno;
+    else {
+        finishLoading();
+        error = editor.readError;
+    }
+    if (error) {
+        snprintf(report, sizeof(report), "%s: %s", fileName, strerror(error));
+        *failed = 1;
+        freeBuffer();
+        return strdup(report);
+    }
+    for (int j = 0; j < job -> numCommands; j ++) {
+        struct batchCommand *c = &job -> commands[j];
+        switch (c -> op) {
+            case BATCH_FIND:
+                if (!batchFind(c -> text)) {
+                    snprintf(report, sizeof(report), "%s: stopped at script line %d, \"%s\" not found", fileName, c -> line, c -> text);
+                    freeBuffer();
+                    return strdup(report);
+                }
+                break;
+            case BATCH_REPLACE: {
+                struct replacer r;
+                int rows;
+                initReplacer(&r, c -> text, c -> with, 0);
+                replaced += replaceAll(&r, &rows);
+                dropUndo(); // nothing to undo in a script
+                break;
+            }
+            case BATCH_GOTO:
+                editor.yCoord = (c -> n - 1 < editor.numrows) ? c -> n - 1 : editor.numrows;
+                editor.xCoord = 0;
+                if (editor.yCoord < editor.numrows)
+                    editor.xCoord = (c -> m - 1 < editor.row[editor.yCoord].size) ? c -> m - 1 : editor.row[editor.yCoord].size;
+                break;
+            case BATCH_INSERT:
+                for (char *p = c -> text; *p; p ++) {
+                    if (*p == '\n') editorInsertNewline();
+                    else editorInsertChar(*p);
+                }
+                break;
+            case BATCH_DELETE:
+                batchDelete(c -> n);
+                break;
+            case BATCH_SAVE:
+                if (writeFile() == -1) {
+                    snprintf(report, sizeof(report), "%s: can't save: %s", fileName, strerror(errno));
+                    *failed = 1;
+                    freeBuffer();
+                    return strdup(report);
+                }
+                saved ++;
+                break;
+        }
+    }
+    snprintf(report, sizeof(report), "%s: %d lines, %d replacement%s%s%s", fileName, editor.numrows, replaced, replaced == 1 ? "" : "s",
+            saved ? ", saved" : "", editor.dirty ? ", unsaved changes" : "");
+    freeBuffer();
+    return strdup(report);
+}
+void *batchWorker(void *arg) {
+    struct batchJob *job = arg;
+    initBuffer();
+    while (1) {
+        pthread_mutex_lock(&job -> lock);
+        int file = job -> next ++;
+        pthread_mutex_unlock(&job -> lock);
+        if (file >= job -> numFiles) return NULL;
+
+        int failed;
+        job -> reports[file] = runBatchFile(job, job -> files[file], &failed);
+        if (failed) {
+            pthread_mutex_lock(&job -> lock);
+            job -> failures ++;
+            pthread_mutex_unlock(&job -> lock);
+        }
+    }
+}
+int batchMain(int argc, char *argv[]) { // typeAway --batch SCRIPT [-j THREADS] FILE...
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), first = 3;
+    if (argc >= 5 && !strcmp(argv[3], "-j")) {
+        threads = atoi(argv[4]);
+        first = 5;
+    }
+    if (argc <= first || threads < 1) {
+        fprintf(stderr, "usage: %s --batch SCRIPT [-j THREADS] FILE...\n", argv[0]);
+        return 2;
+    }
+    struct batchJob job;
+    memset(&job, 0, sizeof(job));
+    job.numCommands = parseBatchScript(argv[2], &job.commands);
+    if (job.numCommands == -1) return 2;
+    job.files = &argv[first];
+    job.numFiles = argc - first;
+    job.reports = calloc(job.numFiles, sizeof(char *));
+    pthread_mutex_init(&job.lock, NULL);
+    signal(SIGPIPE, SIG_IGN); // saveCompressed swaps the handler per call, keep it the same for every worker
+
+    if (threads > job.numFiles) threads = job.numFiles;
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    for (int j = 0; j < threads; j ++) {
+        if (pthread_create(&workers[j], NULL, batchWorker, &job) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (int j = 0; j < threads; j ++) pthread_join(workers[j], NULL);
+
+    for (int j = 0; j < job.numFiles; j ++) {
+        puts(job.reports[j]);
+        free(job.reports[j]);
+    }
+    for (int j = 0; j < job.numCommands; j ++) {
+        free(job.commands[j].text);
+        free(job.commands[j].with);
+    }
+    free(job.commands);
+    free(job.reports);
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+    return job.failures ? 1 : 0;
+}
+
+/*** shared mode ***/
+#define MAX_CLIENTS 64
+struct sharedServer { // the daemon's one buffer, passed from client thread to client thread under lock
+    pthread_mutex_t lock;
+    struct configurations buffer; // editor as the last holder of lock left it
+    int wakeFds[MAX_CLIENTS]; // write ends of the clients' wake pipes, -1 for a free slot
+    int numClients, attached;
+};
+struct sharedServer server = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void enterShared() { // takes the buffer, keeping this thread's view of it
+    pthread_mutex_lock(&server.lock);
+    struct configurations view = editor;
+    editor = server.buffer;
+
+    editor.xCoord = view.xCoord;
+    editor.yCoord = view.yCoord;
+    editor.rx = view.rx;
+    editor.rowOffset = view.rowOffset;
+    editor.colOffset = view.colOffset;
+    editor.segOffset = view.segOffset;
+    editor.softWrap = view.softWrap;
+    editor.screenY = view.screenY;
+    editor.screenX = view.screenX;
+    editor.terminalRows = view.terminalRows;
+    editor.terminalCols = view.terminalCols;
+    memcpy(editor.statusmsg, view.statusmsg, sizeof(editor.statusmsg));
+    editor.statusmsg_time = view.statusmsg_time;
+    editor.bracketRow = view.bracketRow;
+    editor.bracketRx = view.bracketRx;
+    editor.matchRow = view.matchRow;
+    editor.matchRx = view.matchRx;
+    memcpy(editor.overlays, view.overlays, sizeof(editor.overlays));
+    editor.selecting = view.selecting;
+    editor.markX = view.markX;
+    editor.markY = view.markY;
+    editor.macro = view.macro;
+    editor.macroLen = view.macroLen;
+    editor.macroCap = view.macroCap;
+    editor.recording = view.recording;
+    editor.replaying = view.replaying;
+    editor.replayPos = view.replayPos;
+    memcpy(editor.completions, view.completions, sizeof(editor.completions));
+    editor.numCompletions = view.numCompletions;
+    editor.completionSelected = view.completionSelected;
+    editor.completionPrefix = view.completionPrefix;
+    editor.pendingKey = view.pendingKey;
+    editor.inFd = view.inFd;
+    editor.outFd = view.outFd;
+    editor.wakeFd = view.wakeFd;
+    editor.slot = view.slot;
+    editor.detached = view.detached;
+    editor.frame = view.frame;
+    editor.framePopup = view.framePopup;
+    editor.unsent = view.unsent;
+
+    clampCursor(); // other clients may have removed the lines under the cursor
+    if (editor.softWrap && editor.wrapCols != TEXT_COLS) wrapAllRows(); // another client wrapped it at its own width
+}
+void leaveShared() {
+    server.buffer = editor;
+    pthread_mutex_unlock(&server.lock);
+}
+int otherClients() {
+    return editor.wakeFd == -1 ? 0 : server.numClients - 1;
+}
+void wakeClients() { // every other client repaints once it gets the buffer
+    for (int j = 0; j < MAX_CLIENTS; j ++)
+        if (j != editor.slot && server.wakeFds[j] != -1) write(server.wakeFds[j], "", 1);
+}
+void sendUnsent() { // blocks only this client if its connection stalls, the buffer is someone else's meanwhile
+    struct abuf *out = editor.unsent;
+    int sent = 0;
+    while (sent < out -> len) {
+        ssize_t n = write(editor.outFd, &out -> b[sent], out -> len - sent);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break; // hung up, the read side notices
+        sent += n;
+    }
+    out -> len = 0;
+}
+void waitShared() { // lets the other clients have the buffer until a key comes in, repainting what they change
+    while (1) {
+        int busy = editor.loader || diffPending();
+        struct pollfd fds[2] = { { editor.inFd, POLLIN, 0 }, { editor.wakeFd, POLLIN, 0 } };
+        leaveShared();
+        sendUnsent();
+        poll(fds, 2, busy ? 20 : -1);
+        enterShared();
+        if (fds[0].revents) return;
+        char drain[64];
+        while (read(editor.wakeFd, drain, sizeof(drain)) > 0);
+        if (editor.loader) loadPendingRows(30);
+        if (diffTick() || editor.loader) wakeClients();
+        refreshScreen();
+    }
+}
+void drawFrameDiff(struct abuf *ab) { // only the lines that changed since the client's last frame
+    struct abuf frame = ABUF_INIT;
+    indicateRows(&frame);
+    drawStatusBar(&frame);
+    drawMessageBar(&frame);
+    int lines = editor.terminalRows + 2;
+    if (editor.frame == NULL) editor.frame = calloc(lines, sizeof(struct abuf));
+
+    char *line = frame.b, *end = frame.b + frame.len;
+    for (int y = 0; y < lines; y ++) {
+        char *next = memmem(line, end - line, "\r\n", 2);
+        int len = (next ? next : end) - line;
+        struct abuf *last = &editor.frame[y];
+        // a popup covered lines that are not part of it, so they all go again once it closes
+        if (editor.framePopup || last -> len != len || memcmp(last -> b, line, len)) {
+            char buf[32];
+            abAppend(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1));
+            abAppend(ab, line, len);
+            last -> len = 0;
+            abAppend(last, line, len);
+        }
+        if (next == NULL) break;
+        line = next + 2;
+    }
+    abFree(&frame);
+    if (editor.numCompletions) drawCompletions(ab);
+    editor.framePopup = editor.numCompletions > 0;
+}
+void freeFrame() {
+    if (editor.frame) for (int y = 0; y < editor.terminalRows + 2; y ++) abFree(&editor.frame[y]);
+    free(editor.frame);
+    editor.frame = NULL;
+}
+void resizeView(int rows, int cols) { // the client's terminal changed size, so its next frame is drawn whole
+    freeFrame();
+    editor.terminalRows = rows;
+    editor.terminalCols = cols;
+    if (editor.softWrap && editor.wrapCols != TEXT_COLS) wrapAllRows();
+    abAppend(editor.unsent, "\x1b[2J", 4);
+}
+void *serveClient(void *arg) { // one thread per attached terminal
+    int fd = *(int *) arg;
+    free(arg);
+    int size[2], wake[2];
+    if (read(fd, size, sizeof(size)) != sizeof(size) || pipe2(wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+        close(fd);
+        return NULL;
+    }
+    initBuffer();
+    editor.inFd = editor.outFd = fd;
+    editor.wakeFd = wake[0];
+    editor.terminalRows = size[0];
+    editor.terminalCols = size[1];
+    struct abuf unsent = ABUF_INIT;
+    editor.unsent = &unsent;
+
+    enterShared();
+    for (editor.slot = 0; editor.slot < MAX_CLIENTS && server.wakeFds[editor.slot] != -1; editor.slot ++);
+    if (editor.slot < MAX_CLIENTS) {
+        server.wakeFds[editor.slot] = wake[1];
+        server.numClients ++;
+        server.attached = 1;
+        setStatusMessage("\x1b[34m Attached, %d client(s) on this buffer | Ctrl+Q = detach\x1b[m", server.numClients);
+        while (!editor.detached) {
+            refreshScreen();
+            processKey();
+            wakeClients();
+        }
+        server.wakeFds[editor.slot] = -1;
+        server.numClients --;
+        if (editor.softWrap) editor.wrapViews --;
+    }
+    leaveShared();
+
+    freeFrame();
+    free(editor.macro);
+    abFree(&unsent);
+    close(wake[0]);
+    close(wake[1]);
+    close(fd);
+    return NULL;
+}
+void sharedPath(char *fileName, char *path, int size) { // one socket per file, whatever path it was opened by
+    char *full = realpath(fileName, NULL);
+    unsigned int hash = 2166136261u;
+    for (char *p = full ? full : fileName; *p; p ++) hash = (hash ^ (unsigned char) *p) * 16777619u;
+    free(full);
+    snprintf(path, size, "/tmp/typeAway-%08x.sock", hash);
+}
+int connectShared(char *path, uid_t owner) { // -1 unless a server owned by us or by the file's owner is listening
+    struct stat st;
+    if (lstat(path, &st) == -1 || !S_ISSOCK(st.st_mode) || (st.st_uid != getuid() && st.st_uid != owner)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd != -1 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) return fd;
+    if (fd != -1) close(fd);
+    return -1;
+}
+int serverMain(char *fileName, char *path) { // holds the buffer until its last client detaches
+    signal(SIGPIPE, SIG_IGN);
+    struct stat st;
+    if (stat(fileName, &st) == -1) return 1;
+    umask(st.st_mode & S_IWGRP ? 007 : 077); // whoever may write the file may attach to it
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (listenFd == -1 || bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listenFd, 16) == -1) return 1;
+
+    for (int j = 0; j < MAX_CLIENTS; j ++) server.wakeFds[j] = -1;
+    initBuffer();
+    if (editorOpen(fileName) == -1) {
+        unlink(path);
+        return 1;
+    }
+    server.buffer = editor;
+    time_t started = time(NULL);
+    while (1) {
+        enterShared();
+        if (server.attached ? server.numClients == 0 : time(NULL) - started > 10) {
+            unlink(path);
+            leaveShared();
+            break;
+        }
+        int busy = editor.loader || diffPending();
+        if (editor.loader) loadPendingRows(30);
+        if (busy && (diffTick() || editor.loader)) wakeClients();
+        leaveShared();
+
+        struct pollfd listening = { listenFd, POLLIN, 0 };
+        if (poll(&listening, 1, busy ? 20 : 200) <= 0) continue;
+        int *fd = malloc(sizeof(int));
+        pthread_t thread;
+        *fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (*fd != -1 && pthread_create(&thread, NULL, serveClient, fd) == 0) pthread_detach(thread);
+        else {
+            if (*fd != -1) close(*fd);
+            free(fd);
+        }
+    }
+    close(listenFd);
+    return 0;
+}
+volatile sig_atomic_t resized; // set on SIGWINCH, the client passes the new size on to its server
+void noteResize(int sig) {
+    (void) sig;
+    resized = 1;
+}
+int sharedMain(char *fileName) { // typeAway --shared FILE, a thin terminal on a server holding FILE
+    struct stat st;
+    if (stat(fileName, &st) == -1) {
+        perror(fileName);
+        return 1;
+    }
+    char path[sizeof(((struct sockaddr_un *) 0) -> sun_path)];
+    sharedPath(fileName, path, sizeof(path));
+    int fd = connectShared(path, st.st_uid);
+    if (fd == -1) {
+        struct stat old;
+        if (lstat(path, &old) == 0 && old.st_uid == getuid()) unlink(path); // left behind by a server that died
+        pid_t pid = fork();
+        if (pid == 0) {
+            setsid();
+            int null = open("/dev/null", O_RDWR);
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            _exit(serverMain(fileName, path));
+        }
+        for (int tries = 0; pid != -1 && fd == -1 && tries < 100; tries ++) {
+            usleep(20000);
+            fd = connectShared(path, st.st_uid);
+        }
+        if (fd == -1) {
+            fprintf(stderr, "typeAway: no server for %s at %s\n", fileName, path);
+            return 1;
+        }
+    }
+
+    initBuffer();
+    enableRawMode();
+    int size[2];
+    if (getWindowSize(&size[0], &size[1]) == -1) handleError(" getWindowSize");
+    size[0] -= 2; // status bar and message
+    write(fd, size, sizeof(size));
+    struct sigaction winch = { .sa_handler = noteResize };
+    sigaction(SIGWINCH, &winch, NULL); // no SA_RESTART, so poll wakes up for it
+    char buf[4096];
+    while (1) { // keys up, frames down
+        if (resized) {
+            resized = 0;
+            if (getWindowSize(&size[0], &size[1]) != -1) write(fd, buf, snprintf(buf, sizeof(buf), "\x1b[8;%d;%dt", size[0], size[1]));
+        }
+        struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+        if (poll(fds, 2, -1) == -1) continue;
+        if (fds[0].revents & POLLIN) {
+            int n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n > 0) write(fd, buf, n);
+        }
+        if (fds[1].revents) {
+            int n = read(fd, buf, sizeof(buf));
+            if (n <= 0) break;
+            write(STDOUT_FILENO, buf, n);
+        }
+    }
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    return 0;
+}
+
 /*** MAIN ***/
-void initEditor() {
+void initBuffer() { // the state of an empty, unnamed file
     editor.xCoord = editor.yCoord = 0;
     editor.rx = 0;
     editor.rowOffset = editor.colOffset = 0;
+    editor.segOffset = editor.screenY = editor.screenX = 0;
+    editor.softWrap = 0;
+    editor.wrapCols = editor.wrapViews = 0;
     editor.numrows = 0;
     editor.dirty = 0;
     editor.row = NULL;
+    editor.rowCap = 0;
     editor.fileName = NULL;
+    editor.codec = NULL;
+    editor.loader = NULL;
     editor.statusmsg[0] = '\0';
     editor.statusmsg_time = 0;
     editor.syntax = NULL;
-
+    editor.symbols = NULL;
+    editor.numsymbols = editor.symbolCap = 0;
+    editor.rowTree = NULL;
+    editor.rowTreeRoot = editor.rowTreeNodes = editor.rowTreeCap = editor.rowTreeFree = 0;
+    editor.rowTreeSeed = 2463534242u;
+    editor.rowTreeStale = 0;
+    memset(&editor.totals, 0, sizeof(editor.totals));
+    editor.bracketRow = editor.matchRow = -1;
+    for (int j = 0; j < OVERLAY_COUNT; j ++) editor.overlays[j].row = -1;
+    editor.hlScratch = NULL;
+    editor.hlScratchSize = 0;
+    editor.renderScratch = NULL;
+    editor.renderScratchSize = 0;
+    editor.hlBatch = 0;
+    editor.selecting = 0;
+    editor.clipboard = NULL;
+    editor.clipLines = 0;
+    editor.hlSuspended = 0;
+    editor.hlDirty.from = editor.hlDirty.to = -1;
+    editor.macro = NULL;
+    editor.macroLen = editor.macroCap = 0;
+    editor.recording = editor.replaying = 0;
+    editor.readError = 0;
+    editor.undo = NULL;
+    editor.undoRows = 0;
+    editor.undoEdits = editor.edits = 0;
+    editor.savedHashes = NULL;
+    editor.numSaved = editor.savedCap = 0;
+    editor.diffMatch = NULL;
+    editor.diffRows = 0;
+    editor.diffDirty.from = editor.diffDirty.to = -1;
+    editor.diffFull = 1;
+    editor.diffJob = NULL;
+    editor.trie = NULL;
+    editor.trieNodes = editor.trieCap = editor.trieFree = 0;
+    editor.identEpoch = 0;
+    editor.numCompletions = editor.completionSelected = editor.completionPrefix = 0;
+    editor.pendingKey = 0;
+    editor.cacheBytes = editor.indexBytes = 0;
+    editor.cacheTick = 0;
+    editor.cacheQueue = NULL;
+    editor.cacheHead = editor.cacheLen = editor.cacheCap = 0;
+    editor.trimAgainAt = 0;
+    editor.inFd = STDIN_FILENO;
+    editor.outFd = STDOUT_FILENO;
+    editor.wakeFd = editor.slot = -1;
+    editor.detached = 0;
+    editor.frame = NULL;
+    editor.framePopup = 0;
+    editor.unsent = NULL;
+}
+void freeBuffer() { // releases the file initBuffer was followed by and starts over empty
+    if (editor.loader) finishLoading();
+    stopDiff();
+    for (int j = 0; j < editor.numrows; j ++) freeRow(&editor.row[j]);
+    free(editor.row);
+    clearSymbols();
+    free(editor.symbols);
+    free(editor.rowTree);
+    free(editor.hlScratch);
+    free(editor.renderScratch);
+    clearClipboard();
+    dropUndo();
+    free(editor.savedHashes);
+    free(editor.diffMatch);
+    free(editor.trie);
+    free(editor.cacheQueue);
+    free(editor.macro);
+    free(editor.fileName);
+    initBuffer();
+}
+void initEditor() {
+    initBuffer();
     if (getWindowSize(&editor.terminalRows, &editor.terminalCols) == -1) handleError(" getWindowSize");
     editor.terminalRows -= 2; // one for status bar and one for message
 } // initializing all the fields of configurations
 int main(int argc, char *argv[]) {
+    char *budget = getenv("TYPEAWAY_MEM_BUDGET");
+    if (argc >= 3 && !strcmp(argv[1], "--mem-budget")) { // typeAway --mem-budget SIZE ..., before any other mode
+        budget = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if (budget && (memBudget = parseBytes(budget)) == -1) {
+        fprintf(stderr, "typeAway: %s is not a memory budget, try something like 512M or 2G\n", budget);
+        return 1;
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--batch")) return batchMain(argc, argv);
+    if (argc == 3 && !strcmp(argv[1], "--shared")) return sharedMain(argv[2]);
     enableRawMode();
     initEditor();
-    if ( argc >= 2) editorOpen(argv[1]);
+    if ( argc >= 2 && editorOpen(argv[1]) == -1) handleError("fopen");
     //editorOpen();
     //enabling raw mode to process every character as they're entered
     //like entering a password